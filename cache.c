@@ -4,11 +4,15 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
-#include <linux/vmalloc.h>
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/list.h>
 #include <linux/hashtable.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include "cache.h"
 
 /* Enables/Disables the caching */
@@ -18,19 +22,113 @@
 #define FNV_32_PRIME 16777619u
 #define FNV_32_BASIS 2166136261u
 
-/* Configure the number of cache pages here */
-#define NUM_CACHE_PAGES 64
-#define KV_HASH_BITS 20
+/* Bounds of the index size, in buckets, always a power of 2 */
+#define INDEX_MIN_BUCKETS 64
+#define INDEX_MAX_BUCKETS (1U << 24)
+
+/* Old buckets moved into the new index per cache operation */
+#define INDEX_REHASH_STEP 8
+
+/* Share of the budget the 2Q A1in queue may use, in percent */
+#define CACHE_A1IN_PERCENT 25
+
+/* Ghost entries kept in 2Q at least, on top of half the resident ones */
+#define CACHE_GHOST_MIN 64
+
+/* Name of the statistics file in /proc */
+#define CACHE_PROC_NAME "project6_cache"
+
+/* Bytes of nodes, keys and values the cache may hold */
+static unsigned long cache_bytes = 1 << 20;
+module_param(cache_bytes, ulong, 0444);
+MODULE_PARM_DESC(cache_bytes, "Memory budget of the cache in bytes (default: 1MB)");
+
+/* Replacement policy */
+static char *cache_policy = "lru";
+module_param(cache_policy, charp, 0444);
+MODULE_PARM_DESC(cache_policy, "Cache replacement policy, lru or 2q (default: lru)");
+
+enum cache_policy_id {
+	CACHE_POLICY_LRU,
+	CACHE_POLICY_2Q,
+};
 
-/* Head of the double link list of LRU cache */
+static enum cache_policy_id policy = CACHE_POLICY_LRU;
+
+/*
+ * Head of the double link list of LRU cache. With 2Q it is the Am queue,
+ * which only holds the keys read again, either while in the A1in queue or
+ * shortly after leaving it.
+ */
 LIST_HEAD(cache_list);
 
-/* Defines HashTable for the LRU cache */
-DEFINE_HASHTABLE(kv_index_table, KV_HASH_BITS);
+/* 2Q: FIFO of the keys read once, a scan only churns this queue */
+static LIST_HEAD(a1in_list);
+
+/* 2Q: FIFO of the hashes of the keys evicted from A1in */
+static LIST_HEAD(ghost_list);
+
+/**
+ * @brief Hash table indexing the cached nodes by key
+ */
+struct cache_index {
+	struct hlist_head *buckets;
+	uint32_t mask;		/* number of buckets - 1 */
+};
+
+/*
+ * The index grows with the number of cached nodes and shrinks back. On a
+ * resize the nodes are moved from the old table a few buckets at a time,
+ * the old buckets below rehash_pos are already empty.
+ */
+static struct cache_index index_cur;
+static struct cache_index index_old;
+static uint32_t rehash_pos;
+
+/*
+ * Hash table of the ghost entries. There are at most half as many ghosts as
+ * nodes, so it follows the index at half its size, up to what the budget
+ * can hold. Ghosts are few, a resize moves them all at once.
+ */
+static struct hlist_head *ghost_buckets = NULL;
+static uint32_t ghost_mask;
+static uint32_t ghost_max_buckets;
 
-/* Max elements allowed in the cache */
+/**
+ * @brief Hash of a key evicted from A1in, the key itself is not kept
+ */
+struct cache_ghost {
+	uint32_t hash;
+	struct list_head list;
+	struct hlist_node hlist_elem;
+};
+
+/* Elements in the cache */
 uint32_t total_elements = 0;
 
+/* Bytes charged by the elements in the cache */
+static unsigned long used_bytes = 0;
+
+/* Bytes charged by the elements in A1in */
+static unsigned long a1in_bytes = 0;
+
+static uint32_t total_ghosts = 0;
+
+/* Slab of the cached nodes */
+static struct kmem_cache *node_slab = NULL;
+
+/* Slab of the ghost entries */
+static struct kmem_cache *ghost_slab = NULL;
+
+/* Counters of the value lookups, for comparing the policies */
+static uint64_t stat_hits = 0;
+static uint64_t stat_misses = 0;
+static uint64_t stat_evictions = 0;
+static uint64_t stat_ghost_hits = 0;
+
+/* Serializes the cache users, lookups run concurrently under kv_sem */
+static DEFINE_MUTEX(cache_mutex);
+
 
 /**
  * @brief Hash function for the string`
@@ -50,71 +148,175 @@ static unsigned hash_string (const char *str, unsigned bits)
   while (*s != '\0')
     hash = (hash * FNV_32_PRIME) ^ *s++;
 
-  return hash % bits;
+  return bits ? hash % bits : hash;
 }
 #endif
 
 /**
- * @brief Adds the given key into the hash table
+ * @brief Allocates an empty bucket array
  *
- * @param key Key to be added into the hash table
- * @param ptr Pointer of the cached node in the list
+ * @param num_buckets Number of buckets
  *
- * @return 0 on success, -ENOMEM on failure
+ * @return The buckets, NULL on failure
  */
 #if ENABLE_CACHE
-static int index_insert(const char* key, struct cached_node *ptr)
+static struct hlist_head *buckets_alloc(uint32_t num_buckets)
 {
-	struct index_item *node;
-	node = vmalloc(sizeof(struct index_item));
-	if(!node) {
-		printk(KERN_INFO "Could not put key in index");
-		return -ENOMEM;
-	}
-	node->key = key;
-	node->ptr = ptr;
+	size_t bytes = num_buckets * sizeof(struct hlist_head);
+	struct hlist_head *buckets;
+	uint32_t i;
 
-	hlist_add_head(&node->hlist_elem, &kv_index_table[hash_string(key, HASH_SIZE(kv_index_table))]);
-	return 0;
+	/* Small tables stay off vmalloc */
+	if (bytes <= PAGE_SIZE)
+		buckets = kmalloc(bytes, GFP_KERNEL);
+	else
+		buckets = vmalloc(bytes);
+
+	if (!buckets)
+		return NULL;
+
+	for (i = 0; i < num_buckets; i++)
+		INIT_HLIST_HEAD(&buckets[i]);
+
+	return buckets;
 }
 #endif
 
-
 /**
- * @brief Deletes the given key from the hash table
+ * @brief Gets the bucket a hash belongs to
+ *
+ * @param hash Hash of the key
  *
- * @param key Key to be deleted from the hash table
+ * @return Bucket in the old table if it was not moved yet, otherwise in the
+ * current table
  */
 #if ENABLE_CACHE
-static void index_delete(const char *key)
+static struct hlist_head *index_bucket(uint32_t hash)
 {
-	struct index_item *node;
-	struct hlist_node *tmp;
-	hlist_for_each_entry_safe(node, tmp, &kv_index_table[hash_string(key, HASH_SIZE(kv_index_table))], hlist_elem)
-	{
-		hlist_del(&node->hlist_elem);
-		vfree(node);
-	}
+	if (index_old.buckets && (hash & index_old.mask) >= rehash_pos)
+		return &index_old.buckets[hash & index_old.mask];
+
+	return &index_cur.buckets[hash & index_cur.mask];
 }
 #endif
 
 /**
- * @brief Deletes the entire hash table
+ * @brief Moves a few buckets of the old table into the current one, and
+ * frees the old table once it is empty
  */
 #if ENABLE_CACHE
-static void index_clear(void)
+static void index_rehash_step(void)
 {
-	int bkt;
-	struct index_item *node;
+	struct cached_node *node;
 	struct hlist_node *tmp;
-	hash_for_each_safe(kv_index_table, bkt, tmp, node, hlist_elem)
-	{
-		hash_del(&node->hlist_elem);
-		vfree(node);
+	int i;
+
+	if (!index_old.buckets)
+		return;
+
+	for (i = 0; i < INDEX_REHASH_STEP &&
+	     rehash_pos <= index_old.mask; i++, rehash_pos++) {
+		hlist_for_each_entry_safe(node, tmp,
+					  &index_old.buckets[rehash_pos],
+					  hlist_elem) {
+			hlist_del(&node->hlist_elem);
+			hlist_add_head(&node->hlist_elem,
+				       &index_cur.buckets[node->hash &
+							  index_cur.mask]);
+		}
+	}
+
+	if (rehash_pos > index_old.mask) {
+		kvfree(index_old.buckets);
+		index_old.buckets = NULL;
 	}
 }
 #endif
 
+/**
+ * @brief Moves the ghost entries into a table of the given size
+ *
+ * @param num_buckets New number of buckets, bounded by the budget
+ */
+#if ENABLE_CACHE
+static void ghost_resize(uint32_t num_buckets)
+{
+	struct hlist_head *buckets;
+	struct cache_ghost *ghost;
+
+	num_buckets = clamp(num_buckets, (uint32_t)INDEX_MIN_BUCKETS,
+			    ghost_max_buckets);
+
+	if (num_buckets == ghost_mask + 1)
+		return;
+
+	buckets = buckets_alloc(num_buckets);
+
+	/* The current table keeps working, only longer chains */
+	if (!buckets)
+		return;
+
+	list_for_each_entry(ghost, &ghost_list, list)
+		hlist_add_head(&ghost->hlist_elem,
+			       &buckets[ghost->hash & (num_buckets - 1)]);
+
+	kvfree(ghost_buckets);
+	ghost_buckets = buckets;
+	ghost_mask = num_buckets - 1;
+}
+#endif
+
+/**
+ * @brief Starts moving the index into a table of the given size
+ *
+ * @param num_buckets New number of buckets
+ */
+#if ENABLE_CACHE
+static void index_resize(uint32_t num_buckets)
+{
+	struct hlist_head *buckets;
+
+	/* One resize at a time */
+	while (index_old.buckets)
+		index_rehash_step();
+
+	buckets = buckets_alloc(num_buckets);
+
+	/* The current table keeps working, only longer chains */
+	if (!buckets)
+		return;
+
+	index_old = index_cur;
+	index_cur.buckets = buckets;
+	index_cur.mask = num_buckets - 1;
+	rehash_pos = 0;
+
+	ghost_resize(num_buckets / 2);
+}
+#endif
+
+/**
+ * @brief Keeps about one node per bucket, called after each change of the
+ * number of nodes
+ */
+#if ENABLE_CACHE
+static void index_maintain(void)
+{
+	uint32_t num_buckets = index_cur.mask + 1;
+
+	index_rehash_step();
+
+	if (index_old.buckets)
+		return;
+
+	if (total_elements > num_buckets && num_buckets < INDEX_MAX_BUCKETS)
+		index_resize(num_buckets * 2);
+	else if (total_elements < num_buckets / 8 &&
+		 num_buckets > INDEX_MIN_BUCKETS)
+		index_resize(num_buckets / 2);
+}
+#endif
+
 /**
  * @brief Gets the key from the hash table
  *
@@ -123,87 +325,274 @@ static void index_clear(void)
  * @return The pointer to the node in dll, otherwise NULL
  */
 #if ENABLE_CACHE
-static void * index_get(const char* key)
+static struct cached_node *index_get(const char* key)
 {
-	struct index_item *node;
-	hlist_for_each_entry(node,
-			     &kv_index_table[hash_string(
-				key, HASH_SIZE(kv_index_table))], hlist_elem)
+	uint32_t hash = hash_string(key, 0);
+	struct cached_node *node;
+
+	hlist_for_each_entry(node, index_bucket(hash), hlist_elem)
 	{
-		if(strcmp(node->key, key) == 0)
-			return node->ptr;
+		/* The stored hash saves comparing most of the keys */
+		if (node->hash == hash && strcmp(node->key, key) == 0)
+			return node;
 	}
 	return NULL;
 }
 #endif
 
 /**
- * @brief Evicts the LRU node from the cache
+ * @brief Releases a node which is unlinked from the list and the hash table
+ *
+ * @param node Node to be released
  */
 #if ENABLE_CACHE
-static void cache_evict (void)
+static void node_free(struct cached_node *node)
 {
-	struct cached_node *node =
-		list_first_entry(&cache_list, struct cached_node, list);
+	used_bytes -= node->charge;
+
+	if (node->queue == CACHE_QUEUE_A1IN)
+		a1in_bytes -= node->charge;
+
+	if (node->key != node->key_inline)
+		kfree(node->key);
+	kfree(node->val);
+	kmem_cache_free(node_slab, node);
+
+	total_elements--;
+}
+#endif
 
+/**
+ * @brief Unlinks a node from the cache and releases it
+ *
+ * @param node Node to be removed
+ */
+#if ENABLE_CACHE
+static void node_remove(struct cached_node *node)
+{
 	list_del(&node->list);
+	hlist_del(&node->hlist_elem);
+	node_free(node);
+	index_maintain();
+}
+#endif
 
-	index_delete(node->key);
+/**
+ * @brief Drops the oldest ghost entry
+ */
+#if ENABLE_CACHE
+static void ghost_drop_oldest(void)
+{
+	struct cache_ghost *ghost =
+		list_first_entry(&ghost_list, struct cache_ghost, list);
 
-	vfree(node->key);
-	vfree(node->val);
-	vfree(node);
+	list_del(&ghost->list);
+	hash_del(&ghost->hlist_elem);
+	kmem_cache_free(ghost_slab, ghost);
 
-	total_elements--;
+	total_ghosts--;
 }
 #endif
 
 /**
- * @brief Adds the given key, val into the LRU Cache
+ * @brief Remembers the hash of a key evicted from A1in
+ *
+ * @param key Key being evicted
+ */
+#if ENABLE_CACHE
+static void ghost_add(const char *key)
+{
+	struct cache_ghost *ghost = kmem_cache_alloc(ghost_slab, GFP_KERNEL);
+
+	if (!ghost)
+		return;
+
+	ghost->hash = hash_string(key, 0);
+
+	list_add_tail(&ghost->list, &ghost_list);
+	hlist_add_head(&ghost->hlist_elem,
+		       &ghost_buckets[ghost->hash & ghost_mask]);
+
+	total_ghosts++;
+
+	while (total_ghosts > total_elements / 2 + CACHE_GHOST_MIN)
+		ghost_drop_oldest();
+}
+#endif
+
+/**
+ * @brief Looks for the key among the ghost entries and forgets it
+ *
+ * @param key Key being added
+ *
+ * @return true if the key was evicted from A1in recently
+ */
+#if ENABLE_CACHE
+static bool ghost_take(const char *key)
+{
+	uint32_t hash = hash_string(key, 0);
+	struct cache_ghost *ghost;
+
+	hlist_for_each_entry(ghost,
+			     &ghost_buckets[hash & ghost_mask],
+			     hlist_elem)
+	{
+		if (ghost->hash == hash) {
+			list_del(&ghost->list);
+			hash_del(&ghost->hlist_elem);
+			kmem_cache_free(ghost_slab, ghost);
+			total_ghosts--;
+			return true;
+		}
+	}
+
+	return false;
+}
+#endif
+
+/**
+ * @brief Evicts nodes until the given bytes fit in the budget. With 2Q,
+ * A1in is emptied first once above its share, and leaves ghosts behind.
+ *
+ * @param bytes Bytes about to be charged
+ */
+#if ENABLE_CACHE
+static void cache_evict (unsigned long bytes)
+{
+	struct cached_node *node;
+
+	while (used_bytes + bytes > cache_bytes) {
+		if (!list_empty(&a1in_list) &&
+		    (list_empty(&cache_list) ||
+		     a1in_bytes > cache_bytes / 100 * CACHE_A1IN_PERCENT)) {
+			node = list_first_entry(&a1in_list,
+						struct cached_node, list);
+			ghost_add(node->key);
+		} else if (!list_empty(&cache_list)) {
+			node = list_first_entry(&cache_list,
+						struct cached_node, list);
+		} else {
+			break;
+		}
+
+		node_remove(node);
+		stat_evictions++;
+	}
+}
+#endif
+
+/**
+ * @brief Adds the given key, val into the LRU Cache, cache_mutex is held
  *
  * @param key Key to be added
  * @param val Value to be added
  * @param vpage Vpage corresponding to the key
  * @param num_pages Num_pages for the key,val
+ * @param queue Queue receiving the node
  */
-void project6_cache_add (const char *key,
-		const char *val, uint64_t vpage, uint32_t num_pages)
+#if ENABLE_CACHE
+static void __cache_add(const char *key,
+		const char *val, uint64_t vpage, uint32_t num_pages,
+		uint8_t queue)
 {
+	size_t key_len = strlen(key);
+	size_t val_len = strlen(val);
+	struct cached_node *node;
+	unsigned long charge;
 
-#if ENABLE_CACHE
-	struct cached_node *node = vmalloc(sizeof(struct cached_node));
+	charge = sizeof(struct cached_node) + val_len + 1;
+
+	if (key_len >= CACHE_INLINE_KEY)
+		charge += key_len + 1;
+
+	/* Larger than the whole cache */
+	if (charge > cache_bytes)
+		return;
+
+	cache_evict(charge);
+
+	node = kmem_cache_alloc(node_slab, GFP_KERNEL);
 
 	if (!node) {
 		printk("Node allocation failed for caching \n");
 		return;
 	}
 
-	node->key = vmalloc(strlen(key) + 1);
-	if (!node->key) {
-		printk("Key allocation failed for caching \n");
-		return;
-	}
-	node->val = vmalloc(strlen(val) + 1);
-	if (!node->val) {
-		printk("Val allocation failed for caching \n");
+	if (key_len < CACHE_INLINE_KEY)
+		node->key = node->key_inline;
+	else
+		node->key = kmalloc(key_len + 1, GFP_KERNEL);
+
+	node->val = kmalloc(val_len + 1, GFP_KERNEL);
+
+	if (!node->key || !node->val) {
+		printk("Key/Val allocation failed for caching \n");
+		if (node->key && node->key != node->key_inline)
+			kfree(node->key);
+		kfree(node->val);
+		kmem_cache_free(node_slab, node);
 		return;
 	}
 
-	strncpy(node->key, key, strlen(key) + 1);
-	strncpy(node->val, val, strlen(val) + 1);
+	memcpy(node->key, key, key_len + 1);
+	memcpy(node->val, val, val_len + 1);
 
 	node->vpage = vpage;
 	node->num_pages = num_pages;
+	node->charge = charge;
+	node->queue = queue;
+	node->hash = hash_string(key, 0);
+
+	if (queue == CACHE_QUEUE_A1IN) {
+		list_add_tail(&node->list, &a1in_list);
+		a1in_bytes += charge;
+	} else {
+		list_add_tail(&node->list, &cache_list);
+	}
+
+	hlist_add_head(&node->hlist_elem, index_bucket(node->hash));
+
+	used_bytes += charge;
+	total_elements++;
+
+	index_maintain();
+}
+#endif
 
-	if (total_elements == NUM_CACHE_PAGES) {
-		cache_evict();
+/**
+ * @brief Adds the given key, val into the LRU Cache
+ *
+ * @param key Key to be added
+ * @param val Value to be added
+ * @param vpage Vpage corresponding to the key
+ * @param num_pages Num_pages for the key,val
+ */
+void project6_cache_add (const char *key,
+		const char *val, uint64_t vpage, uint32_t num_pages)
+{
+#if ENABLE_CACHE
+	uint8_t queue;
+
+	mutex_lock(&cache_mutex);
+
+	/* Another lookup of the same key may have added it meanwhile */
+	if (index_get(key)) {
+		mutex_unlock(&cache_mutex);
+		return;
 	}
 
-	list_add_tail(&node->list, &cache_list);
+	/* 2Q: only the keys read again after leaving A1in go to Am */
+	if (policy == CACHE_POLICY_LRU)
+		queue = CACHE_QUEUE_AM;
+	else if (ghost_take(key)) {
+		stat_ghost_hits++;
+		queue = CACHE_QUEUE_AM;
+	} else
+		queue = CACHE_QUEUE_A1IN;
 
-	index_insert(node->key, node);
+	__cache_add(key, val, vpage, num_pages, queue);
 
-	total_elements++;
+	mutex_unlock(&cache_mutex);
 #endif
 }
 
@@ -215,21 +604,16 @@ void project6_cache_add (const char *key,
 void project6_cache_remove(const char *key)
 {
 #if ENABLE_CACHE
-	struct cached_node *node = index_get(key);
-
-	if (!node) {
-		return;
-	}
+	struct cached_node *node;
 
-	list_del(&node->list);
+	mutex_lock(&cache_mutex);
 
-	index_delete(node->key);
+	node = index_get(key);
 
-	vfree(node->key);
-	vfree(node->val);
-	vfree(node);
+	if (node)
+		node_remove(node);
 
-	total_elements--;
+	mutex_unlock(&cache_mutex);
 #endif
 }
 
@@ -245,33 +629,23 @@ void project6_cache_update (const char *key,
 		   const char *val, uint64_t vpage, uint32_t num_pages)
 {
 #if ENABLE_CACHE
-	struct cached_node *node = index_get(key);
-	void *tmp;
+	struct cached_node *node;
+	uint8_t queue = policy == CACHE_POLICY_LRU ?
+		CACHE_QUEUE_AM : CACHE_QUEUE_A1IN;
 
-	if (!node) {
-		project6_cache_add(key, val, vpage, num_pages);
-		return;
-	}
+	mutex_lock(&cache_mutex);
 
-	tmp = node->val;
+	node = index_get(key);
 
-	node->val = vmalloc(strlen(val) + 1);
-	if (!node->val) {
-		printk("Val allocation failed for caching \n");
-		project6_cache_remove(key);
-		return;
+	/* The new value is charged as a new node in the same queue */
+	if (node) {
+		queue = node->queue;
+		node_remove(node);
 	}
 
-	vfree(tmp);
-
-	strncpy(node->val, val, strlen(val) + 1);
+	__cache_add(key, val, vpage, num_pages, queue);
 
-	node->vpage = vpage;
-	node->num_pages = num_pages;
-
-	list_del(&node->list);
-
-	list_add_tail(&node->list, &cache_list);
+	mutex_unlock(&cache_mutex);
 #endif
 }
 
@@ -290,18 +664,40 @@ int project6_cache_lookup(const char *key, char *val,
 		 uint64_t *vpage, uint32_t *num_pages)
 {
 #if ENABLE_CACHE
-	struct cached_node *node = index_get(key);
+	struct cached_node *node;
+
+	mutex_lock(&cache_mutex);
+
+	node = index_get(key);
 
+	/* Only the reads of values count, writers look up the vpage */
 	if (!node) {
+		if (val)
+			stat_misses++;
+		mutex_unlock(&cache_mutex);
 		return 0;
 	}
 
-	if (val)
+	if (val) {
 		strcpy(val, node->val);
+		stat_hits++;
+	}
 
 	*vpage = node->vpage;
 	*num_pages = node->num_pages;
 
+	/* 2Q: a key read again while in A1in has proven to be hot */
+	if (val && node->queue == CACHE_QUEUE_A1IN) {
+		a1in_bytes -= node->charge;
+		node->queue = CACHE_QUEUE_AM;
+	}
+
+	/* Most recently used at the tail, A1in stays in FIFO order */
+	if (node->queue == CACHE_QUEUE_AM)
+		list_move_tail(&node->list, &cache_list);
+
+	mutex_unlock(&cache_mutex);
+
 	return 1;
 #else
 	return 0;
@@ -318,19 +714,146 @@ void project6_cache_clean(void)
 	struct cached_node *node;
 	struct cached_node *next;
 
-	if (!list_empty(&cache_list)) {
-		list_for_each_entry_safe(node, next, &cache_list, list)
-		{
-			list_del(&node->list);
+	mutex_lock(&cache_mutex);
 
-			vfree(node->key);
-			vfree(node->val);
-			vfree(node);
+	list_for_each_entry_safe(node, next, &cache_list, list)
+		node_remove(node);
 
-			total_elements--;
-		}
+	list_for_each_entry_safe(node, next, &a1in_list, list)
+		node_remove(node);
+
+	while (!list_empty(&ghost_list))
+		ghost_drop_oldest();
+
+	mutex_unlock(&cache_mutex);
+#endif
+}
+
+/**
+ * @brief Prints the cache statistics into /proc/project6_cache
+ */
+#if ENABLE_CACHE
+static int cache_stats_show(struct seq_file *m, void *v)
+{
+	uint64_t lookups;
+	uint64_t ratio;
+
+	mutex_lock(&cache_mutex);
+
+	lookups = stat_hits + stat_misses;
+	ratio = lookups ? stat_hits * 10000 / lookups : 0;
+
+	seq_printf(m, "policy: %s\n",
+		   policy == CACHE_POLICY_2Q ? "2q" : "lru");
+	seq_printf(m, "hits: %llu\n", stat_hits);
+	seq_printf(m, "misses: %llu\n", stat_misses);
+	seq_printf(m, "hit_ratio: %llu.%02llu%%\n", ratio / 100, ratio % 100);
+	seq_printf(m, "evictions: %llu\n", stat_evictions);
+	seq_printf(m, "ghost_hits: %llu\n", stat_ghost_hits);
+	seq_printf(m, "entries: %u\n", total_elements);
+	seq_printf(m, "bytes: %lu/%lu\n", used_bytes, cache_bytes);
+	seq_printf(m, "a1in_bytes: %lu\n", a1in_bytes);
+	seq_printf(m, "ghosts: %u\n", total_ghosts);
+	seq_printf(m, "index_buckets: %u\n", index_cur.mask + 1);
+	seq_printf(m, "ghost_buckets: %u\n", ghost_mask + 1);
+
+	mutex_unlock(&cache_mutex);
+
+	return 0;
+}
+
+static int cache_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cache_stats_show, NULL);
+}
+
+static const struct file_operations cache_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = cache_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+#endif
+
+/**
+ * @brief Creates the slabs of the cache, selects the replacement policy
+ * and registers the statistics file
+ *
+ * @return 0 on success, -ENOMEM on failure
+ */
+int project6_cache_init(void)
+{
+#if ENABLE_CACHE
+	unsigned long max_ghosts;
+
+	if (!strcmp(cache_policy, "2q")) {
+		policy = CACHE_POLICY_2Q;
+	} else {
+		if (strcmp(cache_policy, "lru"))
+			printk("Unknown cache policy %s, using lru \n",
+			       cache_policy);
+		policy = CACHE_POLICY_LRU;
+	}
+
+	node_slab = KMEM_CACHE(cached_node, SLAB_HWCACHE_ALIGN);
+	ghost_slab = KMEM_CACHE(cache_ghost, 0);
+
+	index_cur.buckets = buckets_alloc(INDEX_MIN_BUCKETS);
+	index_cur.mask = INDEX_MIN_BUCKETS - 1;
+
+	/* Each node charges its struct and a value of one byte at least */
+	max_ghosts = cache_bytes / (sizeof(struct cached_node) + 1) / 2 +
+		CACHE_GHOST_MIN;
+	ghost_max_buckets = roundup_pow_of_two(min(max_ghosts,
+						   (unsigned long)INDEX_MAX_BUCKETS));
+
+	ghost_buckets = buckets_alloc(INDEX_MIN_BUCKETS);
+	ghost_mask = INDEX_MIN_BUCKETS - 1;
+
+	if (!node_slab || !ghost_slab || !index_cur.buckets ||
+	    !ghost_buckets) {
+		printk("Slab creation failed for caching \n");
+		project6_cache_destroy();
+		return -ENOMEM;
+	}
+
+	if (!proc_create(CACHE_PROC_NAME, 0444, NULL, &cache_stats_fops))
+		printk("Could not create /proc/%s \n", CACHE_PROC_NAME);
+#endif
+	return 0;
+}
+
+/**
+ * @brief Empties the cache and destroys the slabs of the cache
+ */
+void project6_cache_destroy(void)
+{
+#if ENABLE_CACHE
+	if (node_slab && ghost_slab && index_cur.buckets && ghost_buckets) {
+		remove_proc_entry(CACHE_PROC_NAME, NULL);
+		project6_cache_clean();
 	}
 
-	index_clear();
+	if (index_old.buckets)
+		kvfree(index_old.buckets);
+	if (index_cur.buckets)
+		kvfree(index_cur.buckets);
+
+	index_old.buckets = NULL;
+	index_cur.buckets = NULL;
+
+	if (ghost_buckets)
+		kvfree(ghost_buckets);
+
+	ghost_buckets = NULL;
+
+	if (node_slab)
+		kmem_cache_destroy(node_slab);
+	if (ghost_slab)
+		kmem_cache_destroy(ghost_slab);
+
+	node_slab = NULL;
+	ghost_slab = NULL;
 #endif
 }
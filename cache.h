@@ -1,8 +1,16 @@
 #ifndef PROJECT6_CACHE_H
 #define PROJECT6_CACHE_H
 
+/* Keys shorter than this are stored inside the node */
+#define CACHE_INLINE_KEY 64
+
+/* Queue holding a node: the LRU list, or the FIFO of first reads in 2Q */
+#define CACHE_QUEUE_AM 0
+#define CACHE_QUEUE_A1IN 1
+
 /**
- * @brief Structure of the node in the double link list
+ * @brief Structure of the node in the double link list, allocated from a
+ * slab and linked in the hash table as well
  */
 struct cached_node
 {
@@ -10,23 +18,38 @@ struct cached_node
 
     uint32_t num_pages;
 
+    /* Bytes charged to the cache budget */
+    uint32_t charge;
+
+    uint8_t queue;
+
+    /* Full hash of the key, checked before comparing the keys */
+    uint32_t hash;
+
+    /* Points to key_inline for the short keys */
     char *key;
 
     char *val;
 
     struct list_head list;
+
+    struct hlist_node hlist_elem;
+
+    char key_inline[CACHE_INLINE_KEY];
 };
 
 /**
- * @brief Structure of the node in the hash table
+ * @brief Creates the slabs of the cache, selects the replacement policy
+ * and registers the statistics file
+ *
+ * @return 0 on success, -ENOMEM on failure
  */
-struct index_item {
-     const char* key;
-
-     struct cached_node *ptr;
+int project6_cache_init(void);
 
-     struct hlist_node hlist_elem;
-};
+/**
+ * @brief Empties the cache and destroys the slabs of the cache
+ */
+void project6_cache_destroy(void);
 
 /**
  * @brief Deletes the entire cache
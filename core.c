@@ -24,6 +24,10 @@
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/jiffies.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
 #include "core.h"
 #include "device.h"
 #include "cache.h"
@@ -46,6 +50,89 @@ project6_cfg data_config;
  */
 uint8_t *page_buffer = NULL;
 
+/**
+ * @brief Protects the mapper, the bitmap and the key index: taken for read
+ * by the lookups and for write by everything which modifies them
+ */
+DECLARE_RWSEM(kv_sem);
+
+/**
+ * @brief Context used by the operations holding kv_sem for write
+ */
+project6_ctx *writer_ctx = NULL;
+
+/**
+ * @brief Thread reading the meta-data once the device is registered
+ */
+static struct task_struct *load_thread = NULL;
+
+/**
+ * @brief Requests arriving during the load wait here
+ */
+static DECLARE_WAIT_QUEUE_HEAD(load_wait);
+
+/**
+ * @brief Set once the meta-data is in memory
+ */
+static atomic_t mounted = ATOMIC_INIT(0);
+
+/**
+ * @brief Set once the meta-data was read or built, only then is it flushed
+ * at exit
+ */
+static bool meta_loaded;
+
+/**
+ * @brief Background threads the load started, only those are stopped at
+ * exit
+ */
+static bool gc_started;
+static bool flusher_started;
+
+/**
+ * @brief Allocates the state of an opener of the device
+ *
+ * @return The context, NULL on failure
+ */
+project6_ctx *project6_ctx_create(void)
+{
+	project6_ctx *ctx = kmalloc(sizeof(project6_ctx), GFP_KERNEL);
+
+	if (!ctx)
+		return NULL;
+
+	mutex_init(&ctx->lock);
+	ctx->page_buffer = kmalloc(data_config.page_size, GFP_KERNEL);
+	ctx->packed_buffer = kmalloc(data_config.page_size, GFP_KERNEL);
+	ctx->packed_ppage = PAGE_UNALLOCATED;
+	ctx->packed_gen = 0;
+
+	if (!ctx->page_buffer || !ctx->packed_buffer) {
+		project6_ctx_destroy(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+/**
+ * @brief Releases the state of an opener of the device
+ *
+ * @param ctx Context to be released
+ */
+void project6_ctx_destroy(project6_ctx *ctx)
+{
+	if (!ctx)
+		return;
+
+	if (ctx->page_buffer)
+		kfree(ctx->page_buffer);
+	if (ctx->packed_buffer)
+		kfree(ctx->packed_buffer);
+
+	kfree(ctx);
+}
+
 
 /**
  * @brief Destroys the config
@@ -283,14 +370,18 @@ static int format_config(project6_cfg *config,
 }
 
 /**
- * @brief Performs format of the disk
+ * @brief Formats both partitions and rebuilds the meta-data, kv_sem is
+ * held for write
  *
  * @return 0 for success, otherwise appropriate error codes
  */
-int format(void)
+static int format_partitions(void)
 {
 	int ret = 0;
 
+	/* The meta-data in memory no longer matches the flash */
+	meta_loaded = false;
+
 	ret = format_config(&data_config, data_format_callback);
 
 	if (ret != 0) {
@@ -306,13 +397,7 @@ int format(void)
 	}
 
 	total_written_page = 0;
-
-	ret = project6_create_meta_data(&meta_config, 0);
-
-	if (ret != 0) {
-		printk(PRINT_PREF "Creating metadata failed\n");
-		return ret;
-	}
+	log_vpage = 0;
 
 	ret = project6_construct_meta_data(&meta_config, &data_config, false);
 
@@ -321,16 +406,106 @@ int format(void)
 		return ret;
 	}
 
+	meta_loaded = true;
+
+	/* The flash is usable from the first root on */
+	project6_flush_meta_data_to_flash(&meta_config);
+
 	project6_cache_clean();
 
 	return ret;
 }
 
+/**
+ * @brief Performs format of the disk
+ *
+ * @return 0 for success, otherwise appropriate error codes
+ */
+int format(void)
+{
+	int ret;
+
+	ret = project6_wait_mounted();
+
+	if (ret)
+		return ret;
+
+	down_write(&kv_sem);
+
+	ret = format_partitions();
+
+	up_write(&kv_sem);
+
+	return ret;
+}
+
+/**
+ * @brief Waits until the meta-data read at mount is in memory, the
+ * requests call it before taking kv_sem
+ *
+ * @return 0 once mounted, -ERESTARTSYS if a signal interrupted the wait
+ */
+int project6_wait_mounted(void)
+{
+	return wait_event_interruptible(load_wait, atomic_read(&mounted));
+}
+
+/**
+ * @brief Reads the meta-data and starts the background threads which work
+ * on it. An unformatted flash still lets the requests in, they fail until
+ * the format.
+ */
+static void load_meta_data(void)
+{
+	ktime_t kt, start_kt, stop_kt;
+	int ret;
+
+	start_kt = ktime_get();
+
+	ret = project6_construct_meta_data(&meta_config, &data_config, true);
+
+	if (ret == 0) {
+		meta_loaded = true;
+		project6_print_block_stats();
+	}
+
+	/* Writers collect garbage by themselves without the thread */
+	gc_started = project6_gc_start() == 0;
+
+	/* Requests flush the meta-data by themselves without the thread */
+	flusher_started = project6_meta_flusher_start() == 0;
+
+	stop_kt = ktime_get();
+
+	kt = ktime_sub(stop_kt, start_kt);
+
+	printk(PRINT_PREF "Meta-data load time: %llu usecs\n", (kt.tv64)/1000);
+
+	atomic_set(&mounted, 1);
+	wake_up(&load_wait);
+}
+
+/**
+ * @brief Loader thread, reading the whole meta-data takes time linear in
+ * the partition sizes so it is done once the device accepts requests
+ *
+ * @param data Unused
+ *
+ * @return 0
+ */
+static int load_thread_fn(void *data)
+{
+	load_meta_data();
+
+	return 0;
+}
+
 /**
  * Module initialization function
  */
 static int __init lkp_kv_init(void)
 {
+	struct task_struct *thread;
 	ktime_t kt, start_kt, stop_kt;
 
 	printk(PRINT_PREF "Loading... \n");
@@ -354,13 +529,34 @@ static int __init lkp_kv_init(void)
 		return -ENOMEM;
 	}
 
-	project6_construct_meta_data(&meta_config, &data_config, true);
+	if (project6_cache_init() != 0) {
+		printk(PRINT_PREF "Cache initialization failed\n");
+		return -ENOMEM;
+	}
+
+	writer_ctx = project6_ctx_create();
+
+	if (writer_ctx == NULL) {
+		printk(PRINT_PREF "Writer context allocation failed\n");
+		return -ENOMEM;
+	}
 
 	if (device_init() != 0) {
 		printk(PRINT_PREF "Virtual device creation error\n");
 		return -1;
 	}
 
+	/* The requests wait for the loader, it is held until the exit */
+	thread = kthread_run(load_thread_fn, NULL, "project6_load");
+
+	if (IS_ERR(thread)) {
+		printk(PRINT_PREF "Starting the loader thread failed\n");
+		load_meta_data();
+	} else {
+		get_task_struct(thread);
+		load_thread = thread;
+	}
+
 	stop_kt = ktime_get();
 
 	kt = ktime_sub(stop_kt, start_kt);
@@ -378,9 +574,31 @@ static void __exit lkp_kv_exit(void)
 {
 	printk(PRINT_PREF "Exiting ... \n");
 
-	project6_flush_meta_data_to_flash(&meta_config);
+	/*
+	 * A load already running goes to its end, one which did not start yet
+	 * never runs. Either way nothing is loading past this point.
+	 */
+	if (load_thread) {
+		kthread_stop(load_thread);
+		put_task_struct(load_thread);
+	}
 
-	project6_cache_clean();
+	load_thread = NULL;
+
+	if (gc_started)
+		project6_gc_stop();
+
+	if (flusher_started)
+		project6_meta_flusher_stop();
+
+	/* A failed or skipped load leaves nothing worth writing back */
+	if (meta_loaded) {
+		down_write(&kv_sem);
+		project6_flush_meta_data_to_flash(&meta_config);
+		up_write(&kv_sem);
+	}
+
+	project6_cache_destroy();
 
 	device_exit();
 
@@ -390,11 +608,9 @@ static void __exit lkp_kv_exit(void)
 	if (page_buffer)
 		kfree(page_buffer);
 
-	if (bitmap)
-		kfree(bitmap);
+	project6_ctx_destroy(writer_ctx);
 
-	if (mapper)
-		kfree(mapper);
+	project6_destroy_meta_data();
 }
 
 /* Setup init and exit functions */
@@ -3,15 +3,38 @@
 
 #include <linux/mtd/mtd.h>
 #include <linux/semaphore.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
 
 /* Markers for the key */
 #define NEW_KEY 0x20000000
 #define PREVIOUS_KEY 0x10000000
 
+/* Marker of a page holding several small records */
+#define PACKED_PAGE 0x40000000
+
+/* Records up to page_size / PACK_RECORD_FRACTION bytes are packed */
+#define PACK_RECORD_FRACTION 4
+
+/* Maximum number of records in a packed page */
+#define PACK_MAX_SLOTS 64
+
 /* Vpage status */
 #define PAGE_UNALLOCATED 0xFFFFFFFFFFFFFFFF
 #define PAGE_GARBAGE_RECLAIMED 0x8FFFFFFFFFFFFFFF
 
+/*
+ * A mapper entry of a packed record holds slot + 1 above the ppage, 0 there
+ * means the vpage owns the whole page. The sentinels above have 0xFF there.
+ * The mapper stores the entries on 32 bits when they fit, with 7 bits for
+ * the slot, so PACK_MAX_SLOTS stays below 126.
+ */
+#define MAPPER_SLOT_SHIFT 48
+#define MAPPER_PPAGE(entry) ((entry) & ((1ULL << MAPPER_SLOT_SHIFT) - 1))
+#define MAPPER_SLOT(entry) (((entry) >> MAPPER_SLOT_SHIFT) & 0xFF)
+#define MAPPER_PACK(ppage, slot) \
+	((ppage) | ((uint64_t)((slot) + 1) << MAPPER_SLOT_SHIFT))
+
 /* The below status are for ppage */
 
 /* Not stored on flash */
@@ -25,6 +48,12 @@
 /* Not stored on flash */
 #define PAGE_RECLAIMED 0x4
 
+/* Not stored on flash, the mapper page of the vpage could not be read */
+#define PAGE_LOOKUP_ERROR 0x5
+
+/* No record starts at the vpage */
+#define KEY_FP_NONE 0x0
+
 /* global attributes for our system */
 typedef struct {
 	struct mtd_info *mtd;	/* pointer to the used flash partition mtd_info object */
@@ -39,12 +68,55 @@ typedef struct {
 
 } project6_cfg;
 
+/*
+ * State of one opener of the device. Lookups read the flash through their
+ * own buffers, so several of them can run at the same time. The threads
+ * sharing an open file take turns on its buffers.
+ */
+typedef struct {
+	struct mutex lock;	/* held by the lookups using the buffers */
+	uint8_t *page_buffer;	/* page read by the lookups */
+	uint8_t *packed_buffer;	/* last packed page read */
+	uint64_t packed_ppage;	/* ppage held in packed_buffer */
+	uint64_t packed_gen;	/* packed page generation of packed_buffer */
+} project6_ctx;
+
+/* Page counts of a data block, persisted with the meta-data */
+typedef struct {
+	uint32_t valid;
+	uint32_t invalid;
+	uint32_t free;
+	uint32_t last_write;	/* write clock when a page was last programmed */
+	uint32_t erase_count;	/* erases done by the garbage collection */
+	uint32_t bad;		/* an erase failed, the block is out of use */
+} project6_block_info;
+
 extern project6_cfg data_config;
 extern project6_cfg meta_config;
+extern struct rw_semaphore kv_sem;
+extern project6_ctx *writer_ctx;
 extern uint8_t *page_buffer;
 extern uint64_t total_written_page;
+extern uint64_t log_vpage;
 extern uint8_t *bitmap;
-extern uint64_t *mapper;
+extern uint32_t *key_fp;
+extern uint8_t *key_bloom;
+extern uint8_t *slot_live;
+extern project6_block_info *block_info;
+
+/**
+ * @brief Allocates the state of an opener of the device
+ *
+ * @return The context, NULL on failure
+ */
+project6_ctx *project6_ctx_create(void);
+
+/**
+ * @brief Releases the state of an opener of the device
+ *
+ * @param ctx Context to be released
+ */
+void project6_ctx_destroy(project6_ctx *ctx);
 
 /**
  * @brief Performs set/update of key
@@ -52,29 +124,60 @@ extern uint64_t *mapper;
  * @param key Key to be updated/set
  * @param val Value for the given key
  *
- * @return 0 for success, -1 for failure
+ * @return 0 for success, -ERESTARTSYS if a signal interrupted the wait for
+ * the mount, -1 for other failures
  */
 int set_keyval(const char *key, const char *val);
 
 /**
  * @brief Gets the value for given key
  *
+ * @param ctx Context of the caller
  * @param key Key to be searched
  * @param val Pointer for the value
  *
- * @return 0 for success, -1 for failure
+ * @return 0 for success, -ERESTARTSYS if a signal interrupted the wait for
+ * the mount, -1 for other failures
  */
-int get_keyval(const char *key, char *val);
+int get_keyval(project6_ctx *ctx, const char *key, char *val);
 
 /**
  * @brief Deletes the given key
  *
  * @param key String for the key
  *
- * @return 0 on success, -1 for failure
+ * @return 0 on success, -EIO if the mapper cannot be read, -ERESTARTSYS
+ * if a signal interrupted the wait for the mount, -1 for other failures
  */
 int del_keyval(const char *key);
 
+/**
+ * @brief Orders the keys of a multi-get by the physical page holding them,
+ * so that records sharing a page or contiguous pages are read together
+ *
+ * @param keys Keys to be read
+ * @param order Filled with the indexes of the keys in reading order
+ * @param count Number of keys
+ *
+ * @return 0 on success, -ENOMEM on failure, -ERESTARTSYS if a signal
+ * interrupted the wait for the mount
+ */
+int mget_order_keys(const char **keys, int *order, int count);
+
+/**
+ * @brief Applies several sets and deletes as one unit
+ *
+ * @param count Number of operations
+ * @param keys Keys of the operations
+ * @param vals Values of the sets, NULL for a delete
+ * @param status Filled with the return code of each operation
+ *
+ * @return 0 on success, -ENOSPC if the batch cannot fit, -1 if it failed
+ * and was rolled back, -ERESTARTSYS if a signal interrupted the wait for the
+ * mount
+ */
+int write_batch(int count, const char **keys, const char **vals, int *status);
+
 /**
  * @brief Performs format of the disk
  *
@@ -82,6 +185,14 @@ int del_keyval(const char *key);
  */
 int format(void);
 
+/**
+ * @brief Waits until the meta-data read at mount is in memory, the
+ * requests call it before taking kv_sem
+ *
+ * @return 0 once mounted, -ERESTARTSYS if a signal interrupted the wait
+ */
+int project6_wait_mounted(void);
+
 /**
  * @brief Reads a page from the flash
  *
@@ -146,19 +257,71 @@ int project6_get_existing_mapping(uint64_t vpage, uint64_t *ppage);
  * @param vpage Vpage to be marked invalid
  * @param num_pages Number of pages to be marked invalid
  *
- * @return 0 on success, otherwise -EPERM
+ * @return 0 on success, -EIO if the mapper cannot be read, otherwise -EPERM
  */
 int project6_mark_vpage_invalid(uint64_t vpage, uint64_t num_pages);
 
 /**
- * @brief Starts Garbage Collection
+ * @brief Collects the block with the most garbage, whatever the free space.
+ * kv_sem is held for write.
  *
- * @param threshold TotalPages/Threshold is the marker when garbage collection
- * starts
+ * @return 0 if a block was collected, -ENOSPC if no block has garbage,
+ * otherwise appropriate error code
+ */
+int project6_gc_collect_one(void);
+
+/**
+ * @brief Checks the free space before a write, kv_sem is held for write.
+ * Below the low watermark the collector thread is woken up and the writer
+ * copies a few pages, more as the free space shrinks. Below the emergency
+ * reserve the writer collects until the reserve is back.
+ */
+void project6_gc_balance(void);
+
+/**
+ * @brief Starts the collector thread and registers the wear statistics file
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_gc_start(void);
+
+/**
+ * @brief Stops the collector thread and removes the wear statistics file
+ */
+void project6_gc_stop(void);
+
+/**
+ * @brief Selects the victim policy and fills the victim priority queue from
+ * the block counters
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_gc_init(void);
+
+/**
+ * @brief Releases the victim priority queue
+ */
+void project6_gc_destroy(void);
+
+/**
+ * @brief Moves a block to the bucket of its new invalid count
+ *
+ * @param block Block number
+ * @param old_invalid Previous number of invalid pages
+ * @param new_invalid Current number of invalid pages
+ */
+void project6_gc_block_update(uint64_t block, uint32_t old_invalid,
+			      uint32_t new_invalid);
+
+/**
+ * @brief Gets the number of pages programmed since a page of the block was
+ * last programmed
+ *
+ * @param block Block number
  *
- * @return Appropriate Error code, 0 on success
+ * @return Age of the block
  */
-int project6_garbage_collection(int threshold);
+uint32_t project6_block_age(uint64_t block);
 
 /**
  * @brief Create mapping for multiple pages
@@ -171,11 +334,157 @@ int project6_garbage_collection(int threshold);
 int project6_create_mapping_multipage(uint64_t vpage, uint32_t num_pages);
 
 /**
- * @brief Finds a free page from the given page
+ * @brief Takes a free page to be filled with packed records
+ *
+ * @param ppage Pointer where the page is returned
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_create_packed_page(uint64_t *ppage);
+
+/**
+ * @brief Takes a free page outside of the given block, it is used by the
+ * garbage collection to migrate a packed page
+ *
+ * @param ppage Pointer where the page is returned
+ * @param blk_number Block number which must be avoided
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_create_packed_page_new_block(uint64_t *ppage,
+					  uint64_t blk_number);
+
+/**
+ * @brief Invalidates a packed page which has no live slot left
+ *
+ * @param ppage Packed page to be released
+ */
+void project6_release_packed_page(uint64_t ppage);
+
+/**
+ * @brief Maps a vpage to a slot of a packed page
+ *
+ * @param vpage Vpage of the record
+ * @param ppage Packed page holding the record
+ * @param slot Slot of the record in the page
+ *
+ * @return 0 on success, -EIO if the mapper cannot be updated
+ */
+int project6_map_slot(uint64_t vpage, uint64_t ppage, int slot);
+
+/**
+ * @brief Gets the slot of a vpage mapped into a packed page
+ *
+ * @param vpage Vpage to be checked
+ * @param ppage Filled with the packed page if not NULL
  *
- * @param ppage Offset from which next free page is found
+ * @return Slot index, -1 if the vpage does not map a slot, -EIO if the
+ * mapper cannot be read
  */
-void project6_fix_free_page_pointer(uint64_t ppage);
+int project6_get_vpage_slot(uint64_t vpage, uint64_t *ppage);
+
+/**
+ * @brief Allocates the free pool and fills it from the bitmap
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_free_pool_init(void);
+
+/**
+ * @brief Releases the free pool
+ */
+void project6_free_pool_destroy(void);
+
+/**
+ * @brief Keeps the free pages of a block from being given while the block
+ * is garbage collected
+ *
+ * @param block Block being collected
+ */
+void project6_free_pool_hold(uint64_t block);
+
+/**
+ * @brief Lets the pages of the held block be given again
+ */
+void project6_free_pool_release(void);
+
+/**
+ * @brief Takes a block out of use after its erase failed, its pages are
+ * neither given nor counted as free anymore
+ *
+ * @param block Block which could not be erased
+ */
+void project6_block_mark_bad(uint64_t block);
+
+/**
+ * @brief Refills the free pool from the bitmap, after the bitmap was loaded
+ * or replaced
+ */
+void project6_free_pool_rebuild(void);
+
+/**
+ * @brief Sets up the page counts of the blocks, a fresh partition has every
+ * page free and a loaded one brings its counts from the meta-data
+ *
+ * @param read_disk true if the counts were read from the meta-data
+ */
+void project6_block_info_init(bool read_disk);
+
+/**
+ * @brief Prints the page counts of the data partition
+ */
+void project6_print_block_stats(void);
+
+/**
+ * @brief Gets the vpage whose record fills the given ppage
+ *
+ * @param ppage Physical page number
+ * @param owner Filled with the owner vpage, PAGE_UNALLOCATED if the page is
+ * not mapped as a whole, like migrated and packed pages
+ *
+ * @return 0 on success, -EIO if the mapper cannot be read
+ */
+int project6_get_ppage_owner(uint64_t ppage, uint64_t *owner);
+
+/**
+ * @brief Sets the mapper entry of a vpage, and accounts the free vpages
+ *
+ * @param vpage Vpage to be updated
+ * @param entry New mapper entry
+ *
+ * @return 0 on success, -EIO if the mapper cannot be updated
+ */
+int project6_set_vpage_mapping(uint64_t vpage, uint64_t entry);
+
+/**
+ * @brief Counts the vpages which do not map any record
+ *
+ * @return Number of free vpages
+ */
+uint64_t project6_count_free_vpages(void);
+
+/**
+ * @brief Allocates the reverse map and fills it from the mapper, counting
+ * the free vpages and the live slots of the packed pages as well, so the
+ * mapper is read once. The packed page state must be allocated
+ *
+ * @param num_pages Number of pages in the data partition
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_rmap_init(uint64_t num_pages);
+
+/**
+ * @brief Releases the reverse map
+ */
+void project6_rmap_destroy(void);
+
+/**
+ * @brief Gives an erased block back to the free pool
+ *
+ * @param block Block which was erased
+ */
+void project6_free_block_put(uint64_t block);
 
 /**
  * @brief Callback for datapartition erase operation
@@ -201,29 +510,27 @@ void metadata_format_callback(struct erase_info *e);
 uint8_t project6_get_ppage_state(uint64_t ppage);
 
 /**
- * @brief Set the state for the physical page
+ * @brief Counts the free pages of the data partition
  *
- * @param ppage Physical page number
- * @param state State to be set
+ * @return Number of free pages
  */
-void project6_set_ppage_state(uint64_t ppage, uint8_t state);
+uint64_t project6_count_free_pages(void);
 
 /**
- * @brief Creates a new metadata from scratch
- *
- * @param meta_config Configuration of the meta-data
- * @param block_num block used to create the meta-data
+ * @brief Set the state for the physical page
  *
- * @return returns 0 on success, otherwise appropriate error code
+ * @param ppage Physical page number
+ * @param state State to be set
  */
-int project6_create_meta_data(project6_cfg *meta_config, uint32_t block_num);
+void project6_set_ppage_state(uint64_t ppage, uint8_t state);
 
 /**
  * @brief Construct the in memory meta-data
  *
  * @param meta_config Config Pointer of meta-data partition
  * @param data_config Config Pointer of data partition
- * @param read_disk Read from disk or perform default meta-data construction
+ * @param read_disk Read from disk, or start an empty meta-data on a freshly
+ * erased meta-data partition
  *
  * @return 0 for success, otherwise appropriate error code
  */
@@ -232,14 +539,255 @@ int project6_construct_meta_data(project6_cfg *meta_config,
 			bool read_disk);
 
 /**
- * @brief Flush the meta-data back to flash
+ * @brief Flush the meta-data back to flash. The ranges modified since the
+ * last flush are appended to the journal, once it is full the modified pages
+ * are written with a new root. kv_sem is held for write, or for read by the
+ * flusher thread once the packed page being filled is sealed.
  *
  * @param config Config of the meta-data
  */
 void project6_flush_meta_data_to_flash(project6_cfg *config);
 
 /**
- * @brief Flush the meta-data on periodic basis
+ * @brief Flush the meta-data on periodic basis. With the flusher thread
+ * running, it is only woken up early when modifications piled up.
  */
 void project6_flush_meta_data_timely(void);
+
+/**
+ * @brief Checks if the periodic flush has something to write
+ *
+ * @return true if the meta-data is dirty and the flush period is over, never
+ * when the flusher thread runs
+ */
+bool project6_meta_data_flush_due(void);
+
+/**
+ * @brief Starts the meta-data flusher thread
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_meta_flusher_start(void);
+
+/**
+ * @brief Stops the meta-data flusher thread, the requests flush the
+ * meta-data by themselves again
+ */
+void project6_meta_flusher_stop(void);
+
+/**
+ * @brief Marks the logical pages covering a range of a region as modified
+ *
+ * @param addr First byte modified
+ * @param len Number of bytes modified
+ */
+void project6_mark_meta_data_dirty(const void *addr, size_t len);
+
+/**
+ * @brief Gets the mapper entry of a vpage
+ *
+ * @param vpage Vpage to be looked up
+ * @param entry Filled with the mapper entry
+ *
+ * @return 0 on success, -EIO if its mapper page cannot be read
+ */
+int project6_get_vpage_entry(uint64_t vpage, uint64_t *entry);
+
+/**
+ * @brief Stores the mapper entry of a vpage and marks it modified
+ *
+ * @param vpage Vpage to be updated
+ * @param entry New mapper entry
+ *
+ * @return 0 on success, -EIO if its mapper page cannot be read, the entry
+ * is left unchanged then
+ */
+int project6_put_vpage_entry(uint64_t vpage, uint64_t entry);
+
+/**
+ * @brief Flush the meta-data if it was modified since the last flush
+ */
+void project6_flush_meta_data_if_dirty(void);
+
+/**
+ * @brief Drops the in memory meta-data and reads back the last flushed copy
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_reload_meta_data(void);
+
+/**
+ * @brief Releases the in memory meta-data
+ */
+void project6_destroy_meta_data(void);
+
+/**
+ * @brief Checks if a record is small enough to be packed
+ *
+ * @param key_len Length of the key
+ * @param val_len Length of the value
+ *
+ * @return true if the record goes to a packed page
+ */
+bool project6_is_packed_record(uint32_t key_len, uint32_t val_len);
+
+/**
+ * @brief Counts the packed pages the small records of a batch fill at most
+ *
+ * @param count Number of operations
+ * @param keys Keys of the operations
+ * @param vals Values of the sets, NULL for a delete
+ *
+ * @return Number of pages
+ */
+uint64_t project6_pack_pages_needed(int count, const char **keys,
+				    const char **vals);
+
+/**
+ * @brief Stores a small record into the packed page being filled
+ *
+ * @param vpage Free vpage which identifies the record
+ * @param key Key of the record
+ * @param key_len Length of the key
+ * @param val Value of the record
+ * @param val_len Length of the value
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_pack_record(uint64_t vpage, const char *key, uint32_t key_len,
+			 const char *val, uint32_t val_len);
+
+/**
+ * @brief Writes the packed page being filled on flash
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_pack_seal(void);
+
+/**
+ * @brief Reads a record from a packed page
+ *
+ * @param ctx Context of the caller
+ * @param vpage Vpage of the record
+ * @param key Key expected in the record
+ * @param val Buffer for the value, can be NULL
+ *
+ * @return 0 if the key matches, -1 otherwise
+ */
+int project6_read_packed(project6_ctx *ctx, uint64_t vpage, const char *key,
+			 char *val);
+
+/**
+ * @brief Accounts a dead slot of a packed page
+ *
+ * @param ppage Packed page of the slot
+ */
+void project6_packed_slot_invalid(uint64_t ppage);
+
+/**
+ * @brief Moves the live records of a packed page to a page outside the
+ * block, dropping the dead slots
+ *
+ * @param ppage Packed page to be migrated
+ * @param blk_number Block being garbage collected
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_migrate_packed_page(uint64_t ppage, uint64_t blk_number);
+
+/**
+ * @brief Allocates the packed page state, the live slots are counted by
+ * project6_rmap_init
+ *
+ * @param num_pages Number of pages in the data partition
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_packed_init(uint64_t num_pages);
+
+/**
+ * @brief Releases the packed page state
+ */
+void project6_packed_destroy(void);
+
+/**
+ * @brief Computes the fingerprint of the key
+ *
+ * @param key Key to be fingerprinted
+ *
+ * @return Fingerprint, never KEY_FP_NONE
+ */
+uint32_t project6_key_fingerprint(const char *key);
+
+/**
+ * @brief Adds a head vpage into the index
+ *
+ * @param vpage Vpage holding the head page of the record
+ * @param fp Fingerprint of the key of the record
+ */
+void project6_index_insert(uint64_t vpage, uint32_t fp);
+
+/**
+ * @brief Removes a head vpage from the index
+ *
+ * @param vpage Vpage to be removed
+ */
+void project6_index_remove(uint64_t vpage);
+
+/**
+ * @brief Finds the next candidate head vpage for a fingerprint
+ *
+ * @param fp Fingerprint of the key being searched
+ * @param vpage PAGE_UNALLOCATED to start a search, otherwise the previous
+ * candidate returned
+ *
+ * @return Next candidate vpage, PAGE_UNALLOCATED when there is none left
+ */
+uint64_t project6_index_next(uint32_t fp, uint64_t vpage);
+
+/**
+ * @brief Number of bytes used by the bloom filter
+ *
+ * @param num_vpages Number of vpages in the data partition
+ *
+ * @return Size of the bloom filter in bytes
+ */
+uint64_t project6_bloom_bytes(uint64_t num_vpages);
+
+/**
+ * @brief Adds the fingerprint into the bloom filter
+ *
+ * @param fp Fingerprint of the key
+ */
+void project6_bloom_add(uint32_t fp);
+
+/**
+ * @brief Checks if the fingerprint may have been stored
+ *
+ * @param fp Fingerprint of the key
+ *
+ * @return false if the key is surely absent, true otherwise
+ */
+bool project6_bloom_may_contain(uint32_t fp);
+
+/**
+ * @brief Accounts a deleted key. Bits cannot be cleared from the bloom
+ * filter, so it is rebuilt once deleted keys pile up.
+ */
+void project6_bloom_note_delete(void);
+
+/**
+ * @brief Builds the bucket chains from the fingerprint array, the bloom
+ * filter is expected to be loaded already
+ *
+ * @param num_vpages Number of vpages covered by the fingerprint array
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_index_init(uint64_t num_vpages);
+
+/**
+ * @brief Releases the index
+ */
+void project6_index_destroy(void);
 #endif /* LKP_KV_H */
@@ -26,21 +26,20 @@
 
 #include "core.h"
 
-/* global attributes for the virtual device */
-static atomic_t file_is_open;
-
 /**
  * called when a process opens the virtual device file 
  * i.e. open("/dev/lkp_kv")
  */
 static int device_open(struct inode *inode, struct file *file)
 {
-	/* only a single process can open the device at a time */
-	int is_open = atomic_read(&file_is_open);
-	if (is_open)
-		return -EBUSY;
+	/* any number of processes can open the device, each one gets its
+	 * own buffers so that their lookups run in parallel */
+	project6_ctx *ctx = project6_ctx_create();
+
+	if (!ctx)
+		return -ENOMEM;
 
-	atomic_set(&file_is_open, 1);
+	file->private_data = ctx;
 
 	return 0;
 }
@@ -50,10 +49,198 @@ static int device_open(struct inode *inode, struct file *file)
  */
 static int device_release(struct inode *inode, struct file *file)
 {
-	atomic_set(&file_is_open, 0);
+	project6_ctx_destroy(file->private_data);
+	file->private_data = NULL;
 	return 0;
 }
 
+/**
+ * multi-get: all the keys are copied at once, then read in the order of
+ * the pages holding them
+ */
+static int device_mget(project6_ctx *ctx, keyval_batch *ubatch)
+{
+	keyval_batch batch;
+	keyval *kvs;
+	const char **keys;
+	int *order;
+	char *val;
+	char *key;
+	size_t key_bytes = 0;
+	size_t size;
+	uint8_t *mem;
+	int ret;
+	int i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(keyval_batch)))
+		return -1;
+
+	if (batch.count <= 0 || batch.count > BATCH_MAX_KEYS)
+		return -1;
+
+	kvs = vmalloc(batch.count * sizeof(keyval));
+
+	if (!kvs)
+		return -1;
+
+	if (copy_from_user(kvs, batch.kvs, batch.count * sizeof(keyval))) {
+		vfree(kvs);
+		return -1;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		if (kvs[i].key_len < 0) {
+			vfree(kvs);
+			return -1;
+		}
+		key_bytes += kvs[i].key_len + 1;
+	}
+
+	/* key pointers, reading order, value buffer and the keys themselves */
+	size = batch.count * (sizeof(char *) + sizeof(int)) +
+		4 * data_config.page_size + key_bytes;
+
+	mem = vmalloc(size);
+
+	if (!mem) {
+		vfree(kvs);
+		return -1;
+	}
+
+	keys = (const char **)mem;
+	order = (int *)(mem + batch.count * sizeof(char *));
+	val = (char *)(order + batch.count);
+	key = val + 4 * data_config.page_size;
+
+	ret = 0;
+
+	for (i = 0; i < batch.count; i++) {
+		if (copy_from_user(key, kvs[i].key, kvs[i].key_len + 1)) {
+			ret = -1;
+			goto out;
+		}
+		key[kvs[i].key_len] = '\0';
+		keys[i] = key;
+		key += kvs[i].key_len + 1;
+	}
+
+	ret = mget_order_keys(keys, order, batch.count);
+
+	if (ret)
+		goto out;
+
+	for (i = 0; i < batch.count; i++) {
+		int index = order[i];
+		int status = get_keyval(ctx, keys[index], val);
+
+		if (status >= 0 &&
+		    copy_to_user(kvs[index].val, val, strlen(val) + 1))
+			status = -1;
+
+		put_user(status, &batch.kvs[index].status);
+	}
+
+out:
+	vfree(mem);
+	vfree(kvs);
+
+	return ret;
+}
+
+/**
+ * write batch: all the keys and values are copied at once, then applied
+ * as a single unit
+ */
+static int device_write_batch(keyval_batch *ubatch)
+{
+	keyval_batch batch;
+	keyval *kvs;
+	const char **keys;
+	const char **vals;
+	int *status;
+	char *str;
+	size_t str_bytes = 0;
+	size_t size;
+	uint8_t *mem;
+	int ret;
+	int i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(keyval_batch)))
+		return -1;
+
+	if (batch.count <= 0 || batch.count > BATCH_MAX_KEYS)
+		return -1;
+
+	kvs = vmalloc(batch.count * sizeof(keyval));
+
+	if (!kvs)
+		return -1;
+
+	if (copy_from_user(kvs, batch.kvs, batch.count * sizeof(keyval))) {
+		vfree(kvs);
+		return -1;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		if (kvs[i].key_len < 0 || (kvs[i].val && kvs[i].val_len < 0)) {
+			vfree(kvs);
+			return -1;
+		}
+		str_bytes += kvs[i].key_len + 1;
+		if (kvs[i].val)
+			str_bytes += kvs[i].val_len + 1;
+	}
+
+	/* key and value pointers, return codes and the strings themselves */
+	size = batch.count * (2 * sizeof(char *) + sizeof(int)) + str_bytes;
+
+	mem = vmalloc(size);
+
+	if (!mem) {
+		vfree(kvs);
+		return -1;
+	}
+
+	keys = (const char **)mem;
+	vals = keys + batch.count;
+	status = (int *)(vals + batch.count);
+	str = (char *)(status + batch.count);
+
+	for (i = 0; i < batch.count; i++) {
+		if (copy_from_user(str, kvs[i].key, kvs[i].key_len + 1)) {
+			ret = -1;
+			goto out;
+		}
+		str[kvs[i].key_len] = '\0';
+		keys[i] = str;
+		str += kvs[i].key_len + 1;
+
+		vals[i] = NULL;
+
+		if (!kvs[i].val)
+			continue;
+
+		if (copy_from_user(str, kvs[i].val, kvs[i].val_len + 1)) {
+			ret = -1;
+			goto out;
+		}
+		str[kvs[i].val_len] = '\0';
+		vals[i] = str;
+		str += kvs[i].val_len + 1;
+	}
+
+	ret = write_batch(batch.count, keys, vals, status);
+
+	for (i = 0; i < batch.count; i++)
+		put_user(status[i], &batch.kvs[i].status);
+
+out:
+	vfree(mem);
+	vfree(kvs);
+
+	return ret;
+}
+
 /**
  * ioctl reception. In simplicity order, first study format, then get, 
  * then set
@@ -71,6 +258,10 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num,
 
 			/* copy return code to userspace */
 			put_user(ret, (int *)ioctl_param);
+
+			/* The call is restarted once the signal is handled */
+			if (ret == -ERESTARTSYS)
+				return ret;
 			break;
 		}
 
@@ -112,6 +303,9 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num,
 
 			vfree(key);
 
+			if (ret == -ERESTARTSYS)
+				return ret;
+
 			break;
 		}
 
@@ -168,6 +362,9 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num,
 			/* nettoyage */
 			vfree(val);
 			vfree(key);
+
+			if (ret == -ERESTARTSYS)
+				return ret;
 			break;
 		}
 
@@ -208,7 +405,11 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num,
 			    copy_from_user(key, kv.key, kv.key_len + 1);
 
 			if (!err_bytes_copied) {
-				ret = get_keyval(key, val);	/* appel au coeur du module */
+				project6_ctx *ctx = file->private_data;
+
+				mutex_lock(&ctx->lock);
+				ret = get_keyval(ctx, key, val);	/* appel au coeur du module */
+				mutex_unlock(&ctx->lock);
 				if (ret >= 0) {
 					/* write the result to userspace */
 					err_bytes_copied +=
@@ -227,6 +428,42 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num,
 			vfree(val);
 			vfree(key);
 
+			if (ret == -ERESTARTSYS)
+				return ret;
+
+			break;
+		}
+
+		/* multi-get operation */
+	case IOCTL_MGET:
+		{
+			project6_ctx *ctx = file->private_data;
+			int ret;
+
+			mutex_lock(&ctx->lock);
+			ret = device_mget(ctx, (keyval_batch *)ioctl_param);
+			mutex_unlock(&ctx->lock);
+
+			/* copy return code to userspace */
+			put_user(ret,
+				 (int *)&(((keyval_batch *) (ioctl_param))->status));
+
+			if (ret == -ERESTARTSYS)
+				return ret;
+			break;
+		}
+
+		/* write batch operation */
+	case IOCTL_WRITE_BATCH:
+		{
+			int ret = device_write_batch((keyval_batch *)ioctl_param);
+
+			/* copy return code to userspace */
+			put_user(ret,
+				 (int *)&(((keyval_batch *) (ioctl_param))->status));
+
+			if (ret == -ERESTARTSYS)
+				return ret;
 			break;
 		}
 
@@ -250,8 +487,6 @@ int device_init(void)
 {
 	int ret;
 
-	atomic_set(&file_is_open, 0);
-
 	/* virtual device creation */
 	ret = register_chrdev(MAJOR_NUM, DEVICE_NAME, &Fops);
 	if (ret < 0)
@@ -35,6 +35,20 @@ typedef struct {
 	int status;
 } keyt;
 
+/* data structure representing a batch of operations: an array of keyval,
+ * each with its own return code, as well as a return code for the whole
+ * call. Used by the multi-get and by the write batch, where a NULL val
+ * stands for the deletion of the key.
+ */
+typedef struct {
+	keyval *kvs;
+	int count;
+	int status;
+} keyval_batch;
+
+/* Maximum number of keys in a batch */
+#define BATCH_MAX_KEYS 1024
+
 /* The 4 ioctl commands that can be sent to the virtual device: read operation 
  * (get), write operation (set), delete operation (del) and format operation.
  * The 3rd parameter represents the parameter that is passed when the ioctl
@@ -47,6 +61,14 @@ typedef struct {
 #define IOCTL_FORMAT _IOR(MAJOR_NUM, 2, int *)
 #define IOCTL_DEL _IOR(MAJOR_NUM, 3, keyt *)
 
+/* Multi-get: the parameter is a keyval_batch object (see above) */
+#define IOCTL_MGET _IOR(MAJOR_NUM, 4, keyval_batch *)
+
+/* Atomic batch of sets and deletes: the parameter is a keyval_batch object,
+ * either all of its operations are stored or none of them
+ */
+#define IOCTL_WRITE_BATCH _IOR(MAJOR_NUM, 5, keyval_batch *)
+
 int device_init(void);
 void device_exit(void);
 
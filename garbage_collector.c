@@ -24,18 +24,306 @@
 #include <linux/mtd/mtd.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/vmalloc.h>
 #include <linux/jiffies.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include "core.h"
 #include "device.h"
 
-/* Number of pages written on the flash */
+/* Number of pages written on the flash and not erased yet */
 uint64_t total_written_page = 0;
 
-/* Jiffies for controlling the garbage collector */
-static unsigned long old_jiffies = 0;
-
 #define PRINT_PREF KERN_INFO "GARBAGE_COLLECTOR "
 
+/* Terminates a bucket list */
+#define GC_LIST_END 0xFFFFFFFF
+
+/* Blocks kept free at least by the emergency reserve */
+#define GC_RESERVE_MIN_BLOCKS 2
+
+/* Erases between two checks of the wear of the blocks */
+#define WEAR_CHECK_ERASES 16
+
+/* Name of the wear statistics file in /proc */
+#define WEAR_PROC_NAME "project6_wear"
+
+/*
+ * Free space watermarks, in percent of the data partition. Writers wake up
+ * the collector thread below the low one, which works until the high one is
+ * reached. Writers collect by themselves only below the reserve.
+ */
+static unsigned int gc_low_percent = 40;
+module_param(gc_low_percent, uint, 0444);
+MODULE_PARM_DESC(gc_low_percent, "Free space starting background garbage collection (default: 40)");
+
+static unsigned int gc_high_percent = 50;
+module_param(gc_high_percent, uint, 0444);
+MODULE_PARM_DESC(gc_high_percent, "Free space stopping background garbage collection (default: 50)");
+
+static unsigned int gc_reserve_percent = 10;
+module_param(gc_reserve_percent, uint, 0444);
+MODULE_PARM_DESC(gc_reserve_percent, "Free space below which writers collect garbage themselves (default: 10)");
+
+static unsigned int gc_step_pages = 8;
+module_param(gc_step_pages, uint, 0444);
+MODULE_PARM_DESC(gc_step_pages, "Pages copied by garbage collection per write at most (default: 8)");
+
+static unsigned int wear_threshold = 32;
+module_param(wear_threshold, uint, 0444);
+MODULE_PARM_DESC(wear_threshold, "Erase count spread starting static wear leveling, 0 disables it (default: 32)");
+
+/* Block being collected, GC_LIST_END if none, and its next page to copy */
+static uint32_t gc_victim = GC_LIST_END;
+static uint32_t gc_cursor;
+
+/* Erases since the wear was last checked, and cold blocks moved so far */
+static uint32_t wear_erases;
+static uint64_t wear_moves;
+
+/* Background collector */
+static struct task_struct *gc_thread = NULL;
+static DECLARE_WAIT_QUEUE_HEAD(gc_wait);
+static atomic_t gc_kicked = ATOMIC_INIT(0);
+
+/* Blocks compared by the cost-benefit policy for one victim */
+#define GC_CB_CANDIDATES 32
+
+/* Victim selection policy */
+static char *gc_policy = "greedy";
+module_param(gc_policy, charp, 0444);
+MODULE_PARM_DESC(gc_policy, "Garbage collection victim policy, greedy or cost_benefit (default: greedy)");
+
+enum gc_policy_id {
+	GC_POLICY_GREEDY,
+	GC_POLICY_COST_BENEFIT,
+};
+
+static enum gc_policy_id policy = GC_POLICY_GREEDY;
+
+/*
+ * Priority queue of the blocks, bucketed by their number of invalid pages.
+ * Each bucket is a double linked list of block numbers.
+ */
+static uint32_t *gc_bucket = NULL;
+static uint32_t *gc_next = NULL;
+static uint32_t *gc_prev = NULL;
+
+/* No bucket above this one holds a block */
+static uint32_t gc_top;
+
+/**
+ * @brief Links a block at the head of the bucket of its invalid count
+ *
+ * @param block Block number
+ * @param invalid Number of invalid pages of the block
+ */
+static void gc_link(uint64_t block, uint32_t invalid)
+{
+	gc_prev[block] = GC_LIST_END;
+	gc_next[block] = gc_bucket[invalid];
+
+	if (gc_bucket[invalid] != GC_LIST_END)
+		gc_prev[gc_bucket[invalid]] = block;
+
+	gc_bucket[invalid] = block;
+
+	if (invalid > gc_top)
+		gc_top = invalid;
+}
+
+/**
+ * @brief Unlinks a block from the bucket of its invalid count
+ *
+ * @param block Block number
+ * @param invalid Number of invalid pages of the block
+ */
+static void gc_unlink(uint64_t block, uint32_t invalid)
+{
+	if (gc_prev[block] != GC_LIST_END)
+		gc_next[gc_prev[block]] = gc_next[block];
+	else
+		gc_bucket[invalid] = gc_next[block];
+
+	if (gc_next[block] != GC_LIST_END)
+		gc_prev[gc_next[block]] = gc_prev[block];
+}
+
+/**
+ * @brief Moves a block to the bucket of its new invalid count
+ *
+ * @param block Block number
+ * @param old_invalid Previous number of invalid pages
+ * @param new_invalid Current number of invalid pages
+ */
+void project6_gc_block_update(uint64_t block, uint32_t old_invalid,
+			      uint32_t new_invalid)
+{
+	/* The bad blocks are out of the queue for good */
+	if (!gc_bucket || block_info[block].bad)
+		return;
+
+	gc_unlink(block, old_invalid);
+	gc_link(block, new_invalid);
+}
+
+/**
+ * @brief Scores a block for the cost-benefit policy, the space given back
+ * over the copies needed, weighted by the time since the block was written
+ *
+ * @param block Block number
+ *
+ * @return Score, higher is a better victim
+ */
+static uint64_t gc_cost_benefit(uint64_t block)
+{
+	uint64_t age = project6_block_age(block) + 1;
+
+	return age * block_info[block].invalid / (block_info[block].valid + 1);
+}
+
+/**
+ * @brief Picks the next block to be collected
+ *
+ * @param min_invalid Fewest invalid pages a victim may have
+ *
+ * @return Block number, GC_LIST_END if no block is worth collecting
+ */
+static uint32_t gc_pick_victim(uint32_t min_invalid)
+{
+	uint32_t best = GC_LIST_END;
+	uint64_t best_score = 0;
+	uint64_t score;
+	uint32_t seen = 0;
+	uint32_t invalid;
+	uint32_t block;
+
+	while (gc_top > 0 && gc_bucket[gc_top] == GC_LIST_END)
+		gc_top--;
+
+	for (invalid = gc_top; invalid >= min_invalid && invalid > 0;
+	     invalid--) {
+
+		for (block = gc_bucket[invalid]; block != GC_LIST_END;
+		     block = gc_next[block]) {
+
+			/* Greedy: most invalid pages first */
+			if (policy == GC_POLICY_GREEDY)
+				return block;
+
+			score = gc_cost_benefit(block);
+
+			if (best == GC_LIST_END || score > best_score) {
+				best = block;
+				best_score = score;
+			}
+
+			if (++seen == GC_CB_CANDIDATES)
+				return best;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * @brief Releases the victim priority queue
+ */
+void project6_gc_destroy(void)
+{
+	if (gc_bucket)
+		vfree(gc_bucket);
+	if (gc_next)
+		vfree(gc_next);
+	if (gc_prev)
+		vfree(gc_prev);
+
+	gc_bucket = NULL;
+	gc_next = NULL;
+	gc_prev = NULL;
+}
+
+/**
+ * @brief Selects the victim policy and fills the victim priority queue from
+ * the block counters
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_gc_init(void)
+{
+	uint64_t block;
+
+	project6_gc_destroy();
+
+	if (!strcmp(gc_policy, "cost_benefit")) {
+		policy = GC_POLICY_COST_BENEFIT;
+	} else {
+		if (strcmp(gc_policy, "greedy"))
+			printk(PRINT_PREF "Unknown gc policy %s, using greedy\n",
+			       gc_policy);
+		policy = GC_POLICY_GREEDY;
+	}
+
+	gc_bucket = vmalloc((data_config.pages_per_block + 1) *
+			    sizeof(uint32_t));
+	gc_next = vmalloc(data_config.nb_blocks * sizeof(uint32_t));
+	gc_prev = vmalloc(data_config.nb_blocks * sizeof(uint32_t));
+
+	if (!gc_bucket || !gc_next || !gc_prev) {
+		printk(PRINT_PREF "vmalloc failed for the victim queue\n");
+		project6_gc_destroy();
+		return -ENOMEM;
+	}
+
+	memset(gc_bucket, 0xFF, (data_config.pages_per_block + 1) *
+	       sizeof(uint32_t));
+
+	gc_top = 0;
+	gc_victim = GC_LIST_END;
+
+	for (block = 0; block < data_config.nb_blocks; block++)
+		if (!block_info[block].bad)
+			gc_link(block, block_info[block].invalid);
+
+	return 0;
+}
+
+/**
+ * @brief Frees the vpages still mapping the invalid pages of a block, before
+ * it is erased. A vpage once freed has no page left, so a step which failed
+ * here releases the rest when it is retried
+ *
+ * @param ppage Start page of the block
+ *
+ * @return 0 on success, -EIO if the mapper cannot be read
+ */
+static int gc_release_owners(uint64_t ppage)
+{
+	uint64_t k;
+	uint64_t owner;
+	int ret;
+
+	for (k = ppage; k < ppage + data_config.pages_per_block; k++) {
+		if (project6_get_ppage_state(k) != PAGE_INVALID)
+			continue;
+
+		/* Migrated and packed pages may have no owner */
+		ret = project6_get_ppage_owner(k, &owner);
+
+		if (!ret && owner != PAGE_UNALLOCATED)
+			ret = project6_set_vpage_mapping(owner,
+							 PAGE_GARBAGE_RECLAIMED);
+
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 /**
  * @brief Reclaims all the vpage marked as invalid
  *
@@ -43,7 +331,7 @@ static unsigned long old_jiffies = 0;
  */
 static void project6_reclaim_pages(uint64_t ppage)
 {
-	uint64_t j,k;
+	uint64_t k;
 	uint8_t status;
 
 	for (k = ppage; k < ppage +
@@ -53,68 +341,65 @@ static void project6_reclaim_pages(uint64_t ppage)
 
 		project6_set_ppage_state(k, PAGE_FREE);
 
-		if (status == PAGE_INVALID) {
-			for (j = 0;
-			     j < data_config.nb_blocks *
-			     data_config.pages_per_block;
-			     j++) {
-
-				/*Reverse lookup for ppage-> vpage for invalid
-				 * pages */
-
-				if (mapper[j] == k) {
-					mapper[j] =
-						PAGE_GARBAGE_RECLAIMED;
-					total_written_page--;
-					break;
-				}
-			}
-		}
+		if (status == PAGE_INVALID)
+			total_written_page--;
 	}
 
+	/* The erased block takes new writes again */
+	project6_free_block_put(ppage / data_config.pages_per_block);
 }
 
 /**
- * @brief Migrate a given block to another free block
+ * @brief Migrates the valid pages of the victim block to other blocks,
+ * starting at the cursor
  *
- * @param block_num The block number to be migrated
+ * @param budget Number of pages which may be copied, decremented for each
+ * page copied
  *
  * @return Appropriate error codes, 0 for success
  */
-static int project6_migrate_block(uint64_t block_num)
+static int gc_migrate_pages(uint32_t *budget)
 {
 	/*NOTE: The migration can fail in middle, if there are not enough free
-	 * blocks, this is by design.
+	 * blocks, this is by design. It starts again at the failed page.
 	 */
-	int num_pages = data_config.pages_per_block;
-	uint64_t i = 0;
-	uint64_t j = 0;
-	uint64_t ppage = block_num * data_config.pages_per_block;
+	uint64_t block_num = gc_victim;
+	uint64_t ppage;
+	uint64_t owner;
 	uint64_t npage;
 	int ret;
 	uint8_t status;
 
-	while (j < num_pages) {
+	while (gc_cursor < data_config.pages_per_block) {
+		ppage = block_num * data_config.pages_per_block + gc_cursor;
 		status = project6_get_ppage_state(ppage);
 
-		if (status == PAGE_VALID) {
-
-			for (i = 0; i < data_config.nb_blocks *
-					data_config.pages_per_block; i++) {
-				if (mapper[i] == ppage) {
-					ret = project6_create_mapping_new_block(
-							i,
-							&npage, block_num);
-
-					if (ret < 0) {
-						printk(PRINT_PREF "Creating mapping for migration failed\n");
-						return ret;
-					}
-					/* Incremented by create mapping, hence
-					 * reduce */
-					total_written_page--;
-					break;
-				}
+		if (status == PAGE_VALID && *budget == 0)
+			return 0;
+
+		if (status == PAGE_VALID && slot_live[ppage]) {
+
+			ret = project6_migrate_packed_page(ppage, block_num);
+
+			if (ret < 0) {
+				printk(PRINT_PREF "Migrating packed page failed\n");
+				return ret;
+			}
+
+			(*budget)--;
+
+		} else if (status == PAGE_VALID) {
+
+			ret = project6_get_ppage_owner(ppage, &owner);
+
+			if (ret)
+				return ret;
+
+			/* Nothing refers to the page, nothing to copy */
+			if (owner == PAGE_UNALLOCATED) {
+				project6_set_ppage_state(ppage, PAGE_INVALID);
+				gc_cursor++;
+				continue;
 			}
 
 			ret = read_page(ppage, page_buffer, &data_config);
@@ -124,91 +409,493 @@ static int project6_migrate_block(uint64_t block_num)
 				return ret;
 			}
 
+			ret = project6_create_mapping_new_block(owner, &npage,
+								block_num);
+
+			if (ret < 0) {
+				printk(PRINT_PREF "Creating mapping for migration failed\n");
+				return ret;
+			}
+
 			ret = write_page(npage, page_buffer, &data_config);
 
 			if (ret < 0) {
+				/* The owner keeps the old copy, retried later */
 				printk(PRINT_PREF "Writing page for migration failed\n");
+				project6_set_vpage_mapping(owner, ppage);
+				project6_set_ppage_state(npage, PAGE_INVALID);
 				return ret;
 			}
 
 			project6_set_ppage_state(ppage, PAGE_INVALID);
 
+			(*budget)--;
 		}
 
-		j++;
-		ppage++;
+		gc_cursor++;
 	}
 
 	return 0;
 }
 
 /**
- * @brief Starts Garbage Collection
+ * @brief Starts collecting a block
  *
- * @param threshold TotalPages/Threshold is the marker when garbage collection
- * starts
+ * @param block Victim block
+ */
+static void gc_set_victim(uint32_t block)
+{
+	/* The packed page being filled must be on flash before it can move */
+	project6_pack_seal();
+
+	/* Writers keep off the block until it is erased */
+	project6_free_pool_hold(block);
+
+	gc_victim = block;
+	gc_cursor = 0;
+}
+
+/**
+ * @brief Retires the victim after its erase failed: it leaves the victim
+ * queue and the free pool and its pages are no longer counted, its vpages
+ * were freed before the erase
  *
- * @return Appropriate Error code, 0 on success
+ * @param block Victim block
  */
-int project6_garbage_collection(int threshold)
+static void gc_retire_victim(uint32_t block)
+{
+	gc_unlink(block, block_info[block].invalid);
+
+	project6_block_mark_bad(block);
+
+	gc_victim = GC_LIST_END;
+	project6_free_pool_release();
+}
+
+/**
+ * @brief Performs one bounded step of garbage collection: picks a victim
+ * if none is being collected, copies its valid pages within the budget and
+ * erases it once they are all copied
+ *
+ * @param min_invalid Fewest invalid pages a new victim may have
+ * @param budget Number of pages which may be copied, decremented for each
+ * page copied
+ *
+ * @return 0 on progress, a victim which cannot be erased is retired, -ENOSPC
+ * if no block is worth collecting, otherwise appropriate error code
+ */
+static int gc_step(uint32_t min_invalid, uint32_t *budget)
+{
+	uint32_t block_counter;
+	int ret;
+
+	if (gc_victim == GC_LIST_END) {
+		block_counter = gc_pick_victim(min_invalid);
+
+		if (block_counter == GC_LIST_END)
+			return -ENOSPC;
+
+		gc_set_victim(block_counter);
+	}
+
+	ret = gc_migrate_pages(budget);
+
+	if (ret || gc_cursor < data_config.pages_per_block)
+		return ret;
+
+	block_counter = gc_victim;
+
+	ret = gc_release_owners((uint64_t)block_counter *
+				data_config.pages_per_block);
+
+	if (ret)
+		return ret;
+
+	ret = erase_block(block_counter, 1,
+			&data_config,
+			data_format_callback);
+
+	if (ret) {
+
+		printk(PRINT_PREF "erase block %u for garbage collection failed \n", block_counter);
+		gc_retire_victim(block_counter);
+		return 0;
+	}
+
+	gc_victim = GC_LIST_END;
+	project6_free_pool_release();
+
+	wear_erases++;
+
+	project6_reclaim_pages((uint64_t)block_counter *
+		      data_config.pages_per_block);
+
+	return 0;
+}
+
+/**
+ * @brief Measures the free space, records need both free pages and free
+ * vpages and collecting garbage gives back both
+ *
+ * @return The smaller of the free page and free vpage counts
+ */
+static uint64_t gc_free_space(void)
+{
+	uint64_t free_pages = project6_count_free_pages();
+	uint64_t free_vpages = project6_count_free_vpages();
+
+	return free_pages < free_vpages ? free_pages : free_vpages;
+}
+
+/**
+ * @brief Runs garbage collection steps until the free space target is met
+ * or the budget is spent
+ *
+ * @param min_invalid Fewest invalid pages a new victim may have
+ * @param target Free space at which the collection stops
+ * @param budget Number of pages which may be copied
+ *
+ * @return 0 on success, -ENOSPC if no block is worth collecting, otherwise
+ * appropriate error code
+ */
+static int gc_run(uint32_t min_invalid, uint64_t target, uint32_t budget)
 {
-	uint64_t ppage = 0;
-	uint8_t status;
-	uint64_t num_pages = data_config.nb_blocks *
-		data_config.pages_per_block;
-	int invalid_page_counter = 0;
-	int page_per_block_counter = 0;
-	uint64_t block_counter = 0;
 	int ret;
 
-	if (old_jiffies == 0)
-		old_jiffies = jiffies;
-	else if (time_before(jiffies, old_jiffies + 1 * HZ / 3))
+	/* Nothing to collect on an unformatted flash */
+	if (!gc_bucket)
 		return 0;
-	else
-		old_jiffies = jiffies;
 
-	while (ppage < num_pages) {
+	while (gc_free_space() < target && budget > 0) {
+		ret = gc_step(min_invalid, &budget);
 
-		status = project6_get_ppage_state(ppage);
+		if (ret)
+			return ret;
+	}
 
-		if (status == PAGE_INVALID)
-			invalid_page_counter++;
+	return 0;
+}
+
+/**
+ * @brief Collects the block with the most garbage, whatever the free space.
+ * kv_sem is held for write.
+ *
+ * @return 0 if a block was collected, -ENOSPC if no block has garbage,
+ * otherwise appropriate error code
+ */
+int project6_gc_collect_one(void)
+{
+	uint32_t budget = UINT_MAX;
+
+	if (!gc_bucket)
+		return -ENOSPC;
+
+	/* Without limit the step goes on until its victim is erased */
+	return gc_step(1, &budget);
+}
+
+/**
+ * @brief Converts a watermark into a number of pages
+ *
+ * @param percent Share of the data partition
+ *
+ * @return Number of pages
+ */
+static uint64_t gc_watermark(unsigned int percent)
+{
+	return (uint64_t)data_config.nb_blocks * data_config.pages_per_block *
+		percent / 100;
+}
+
+/**
+ * @brief Gets the free space under which writers collect by themselves
+ *
+ * @return Number of pages
+ */
+static uint64_t gc_reserve(void)
+{
+	uint64_t reserve = gc_watermark(gc_reserve_percent);
+
+	if (reserve < GC_RESERVE_MIN_BLOCKS * data_config.pages_per_block)
+		reserve = GC_RESERVE_MIN_BLOCKS * data_config.pages_per_block;
 
-		ppage++;
+	return reserve;
+}
 
-		page_per_block_counter++;
+/**
+ * @brief Wakes up the collector thread
+ */
+static void gc_kick(void)
+{
+	if (gc_thread) {
+		atomic_set(&gc_kicked, 1);
+		wake_up_interruptible(&gc_wait);
+	}
+}
 
-		if (page_per_block_counter == data_config.pages_per_block) {
+/**
+ * @brief Finds the block holding the coldest data: the least erased of the
+ * full blocks, as it was not collected for long
+ *
+ * @return Block to be moved, GC_LIST_END if the erase counts are close
+ * enough to each other
+ */
+static uint32_t gc_wear_victim(void)
+{
+	uint32_t coldest = GC_LIST_END;
+	uint32_t min_erases = UINT_MAX;
+	uint32_t max_erases = 0;
+	uint32_t erases;
+	uint64_t block;
+
+	for (block = 0; block < data_config.nb_blocks; block++) {
+		if (block_info[block].bad)
+			continue;
+
+		erases = block_info[block].erase_count;
+		max_erases = max(max_erases, erases);
+
+		/* The blocks with free pages are reused by the writers */
+		if (block_info[block].free == 0 && erases < min_erases) {
+			min_erases = erases;
+			coldest = block;
+		}
+	}
 
-			if (invalid_page_counter >= data_config.pages_per_block
-								/ threshold) {
-				ret = project6_migrate_block(block_counter);
+	if (coldest == GC_LIST_END || max_erases - min_erases <= wear_threshold)
+		return GC_LIST_END;
 
-				if (ret) {
-					return ret;
-				}
+	return coldest;
+}
 
-				ret = erase_block(block_counter, 1,
-						&data_config,
-						data_format_callback);
+/**
+ * @brief Static wear leveling step, kv_sem is held for write. Every
+ * WEAR_CHECK_ERASES erases the erase counts are compared, once they drift
+ * apart the coldest block is collected like a victim, so that the writers
+ * get to wear it as well.
+ *
+ * @return 0 on progress, -ENOSPC if there is nothing to move, otherwise
+ * appropriate error code
+ */
+static int gc_wear_level(void)
+{
+	uint32_t budget = gc_step_pages;
+	uint32_t block;
 
-				if (ret) {
+	if (!gc_bucket)
+		return -ENOSPC;
 
-					printk(PRINT_PREF "erase block %llu for garbage collection failed \n", block_counter);
-					return ret;
-				}
+	if (gc_victim == GC_LIST_END) {
+		/* Its valid pages are copied before anything is freed */
+		if (!wear_threshold || wear_erases < WEAR_CHECK_ERASES ||
+		    gc_free_space() < gc_reserve() + data_config.pages_per_block)
+			return -ENOSPC;
 
-				project6_reclaim_pages(block_counter *
-					      data_config.pages_per_block);
+		wear_erases = 0;
 
-			}
-			block_counter++;
-			page_per_block_counter = 0;
-			invalid_page_counter = 0;
+		block = gc_wear_victim();
+
+		if (block == GC_LIST_END)
+			return -ENOSPC;
+
+		gc_set_victim(block);
+		wear_moves++;
+	}
+
+	return gc_step(1, &budget);
+}
+
+/**
+ * @brief Main loop of the collector thread, it collects under kv_sem each
+ * time a writer crossed the low watermark, and levels the wear once enough
+ * blocks were erased
+ *
+ * @param data Unused
+ *
+ * @return 0 when stopped
+ */
+static int gc_thread_fn(void *data)
+{
+	bool more;
+	int ret;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(gc_wait, atomic_read(&gc_kicked) ||
+					 kthread_should_stop());
+
+		if (kthread_should_stop())
+			break;
+
+		atomic_set(&gc_kicked, 0);
+
+		/* kv_sem is let go between the steps for the other users */
+		do {
+			down_write(&kv_sem);
+
+			if (gc_free_space() < gc_watermark(gc_high_percent))
+				ret = gc_run(data_config.pages_per_block / 2,
+					     gc_watermark(gc_high_percent),
+					     gc_step_pages);
+			else
+				ret = gc_wear_level();
+
+			/* A victim is not left half collected */
+			more = !ret && (gc_free_space() <
+					gc_watermark(gc_high_percent) ||
+					gc_victim != GC_LIST_END);
+
+			up_write(&kv_sem);
+		} while (more && !kthread_should_stop());
+
+		if (ret && ret != -ENOSPC)
+			printk(PRINT_PREF "background garbage collection has failed\n");
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Checks the free space before a write, kv_sem is held for write.
+ * Below the low watermark the collector thread is woken up and the writer
+ * copies a few pages, more as the free space shrinks. Below the emergency
+ * reserve the writer collects until the reserve is back.
+ */
+void project6_gc_balance(void)
+{
+	uint64_t free_pages = gc_free_space();
+	uint64_t reserve = gc_reserve();
+	uint64_t low = gc_watermark(gc_low_percent);
+	uint64_t budget;
+	int ret;
+
+	if (free_pages >= low) {
+		/* Enough erases to check the wear again */
+		if (wear_threshold && wear_erases >= WEAR_CHECK_ERASES)
+			gc_kick();
+		return;
+	}
+
+	gc_kick();
+
+	if (free_pages < reserve) {
+		/* Any block with garbage helps, the writer waits for it */
+		ret = gc_run(1, reserve, UINT_MAX);
+	} else {
+		/* Up to gc_step_pages copies as the reserve gets close */
+		budget = gc_step_pages * (low - free_pages);
+		budget = low > reserve ? budget / (low - reserve) : budget;
+
+		ret = gc_run(data_config.pages_per_block / 2, low,
+			     budget ? budget : 1);
+	}
+
+	if (ret && ret != -ENOSPC)
+		printk(PRINT_PREF "garbage collection has failed\n");
+}
+
+/**
+ * @brief Prints the erase counts of the data blocks into /proc/project6_wear
+ */
+static int wear_stats_show(struct seq_file *m, void *v)
+{
+	uint64_t total = 0;
+	uint64_t bad = 0;
+	uint32_t min_erases = UINT_MAX;
+	uint32_t max_erases = 0;
+	uint32_t erases;
+	uint64_t block;
+
+	down_read(&kv_sem);
+
+	if (!block_info) {
+		up_read(&kv_sem);
+		return 0;
+	}
+
+	for (block = 0; block < data_config.nb_blocks; block++) {
+		if (block_info[block].bad) {
+			bad++;
+			continue;
 		}
+
+		erases = block_info[block].erase_count;
+		total += erases;
+		min_erases = min(min_erases, erases);
+		max_erases = max(max_erases, erases);
+	}
+
+	seq_printf(m, "erase_min: %u\n", min_erases);
+	seq_printf(m, "erase_max: %u\n", max_erases);
+	seq_printf(m, "erase_total: %llu\n", total);
+	seq_printf(m, "static_moves: %llu\n", wear_moves);
+	seq_printf(m, "bad_blocks: %llu\n", bad);
+	seq_printf(m, "erase_counts:");
+
+	for (block = 0; block < data_config.nb_blocks; block++) {
+		if (block % 16 == 0)
+			seq_printf(m, "\n%6llu:", block);
+		seq_printf(m, " %u", block_info[block].erase_count);
 	}
 
+	seq_printf(m, "\n");
+
+	up_read(&kv_sem);
+
 	return 0;
 }
 
+static int wear_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wear_stats_show, NULL);
+}
+
+static const struct file_operations wear_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = wear_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * @brief Starts the collector thread and registers the wear statistics file
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_gc_start(void)
+{
+	struct task_struct *thread;
+
+	if (gc_low_percent > gc_high_percent) {
+		printk(PRINT_PREF "gc_low_percent above gc_high_percent, using %u\n",
+		       gc_high_percent);
+		gc_low_percent = gc_high_percent;
+	}
+
+	thread = kthread_run(gc_thread_fn, NULL, "project6_gc");
+
+	if (IS_ERR(thread)) {
+		printk(PRINT_PREF "Starting the garbage collector thread failed\n");
+		return PTR_ERR(thread);
+	}
+
+	gc_thread = thread;
+
+	if (!proc_create(WEAR_PROC_NAME, 0444, NULL, &wear_stats_fops))
+		printk(PRINT_PREF "Could not create /proc/%s\n", WEAR_PROC_NAME);
+
+	return 0;
+}
+
+/**
+ * @brief Stops the collector thread and removes the wear statistics file
+ */
+void project6_gc_stop(void)
+{
+	if (gc_thread) {
+		remove_proc_entry(WEAR_PROC_NAME, NULL);
+		kthread_stop(gc_thread);
+	}
+
+	gc_thread = NULL;
+}
@@ -0,0 +1,355 @@
+/*
+ * In-memory key fingerprint index
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/mtd/mtd.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include "core.h"
+
+#define PRINT_PREF KERN_INFO "KEY_INDEX "
+
+/* Fowler-Noll-Vo 1a constants, for 32-bit word sizes. */
+#define FP_FNV_PRIME 16777619u
+#define FP_FNV_BASIS 2166136261u
+
+/* Terminates a bucket chain */
+#define FP_CHAIN_END 0xFFFFFFFF
+
+/* Bloom filter geometry: one cache line per block, 8 bits per vpage */
+#define BLOOM_BLOCK_BYTES 64
+#define BLOOM_BITS_PER_VPAGE 8
+#define BLOOM_PROBES 6
+
+/**
+ * @brief Fingerprint of the key whose head page is mapped at each vpage,
+ * KEY_FP_NONE when no record starts there. Persisted with the meta-data.
+ */
+uint32_t *key_fp = NULL;
+
+/* Bucket heads, indexed by the low bits of the fingerprint */
+static uint32_t *fp_buckets = NULL;
+
+/* Next vpage in the same bucket, indexed by vpage */
+static uint32_t *fp_next = NULL;
+
+static uint32_t fp_bucket_mask;
+
+/**
+ * @brief Blocked bloom filter over the fingerprints of the stored keys,
+ * persisted with the meta-data.
+ */
+uint8_t *key_bloom = NULL;
+
+static uint64_t bloom_blocks;
+
+/* Number of keys in the index */
+static uint64_t live_keys;
+
+/* Keys deleted since the bloom filter was last rebuilt */
+static uint64_t bloom_stale;
+
+static uint64_t index_vpages;
+
+/**
+ * @brief Computes the fingerprint of the key
+ *
+ * @param key Key to be fingerprinted
+ *
+ * @return Fingerprint, never KEY_FP_NONE
+ */
+uint32_t project6_key_fingerprint(const char *key)
+{
+	const unsigned char *s = (const unsigned char *)key;
+	uint32_t fp = FP_FNV_BASIS;
+
+	while (*s != '\0')
+		fp = (fp ^ *s++) * FP_FNV_PRIME;
+
+	if (fp == KEY_FP_NONE)
+		fp = 1;
+
+	return fp;
+}
+
+/**
+ * @brief Adds a head vpage into the index
+ *
+ * @param vpage Vpage holding the head page of the record
+ * @param fp Fingerprint of the key of the record
+ */
+void project6_index_insert(uint64_t vpage, uint32_t fp)
+{
+	uint32_t *head = &fp_buckets[fp & fp_bucket_mask];
+
+	if (key_fp[vpage] != KEY_FP_NONE)
+		project6_index_remove(vpage);
+
+	key_fp[vpage] = fp;
+	project6_mark_meta_data_dirty(&key_fp[vpage], sizeof(key_fp[vpage]));
+	fp_next[vpage] = *head;
+	*head = vpage;
+
+	live_keys++;
+
+	project6_bloom_add(fp);
+}
+
+/**
+ * @brief Removes a head vpage from the index
+ *
+ * @param vpage Vpage to be removed
+ */
+void project6_index_remove(uint64_t vpage)
+{
+	uint32_t fp = key_fp[vpage];
+	uint32_t *link;
+
+	if (fp == KEY_FP_NONE)
+		return;
+
+	link = &fp_buckets[fp & fp_bucket_mask];
+
+	while (*link != FP_CHAIN_END) {
+		if (*link == vpage) {
+			*link = fp_next[vpage];
+			break;
+		}
+		link = &fp_next[*link];
+	}
+
+	key_fp[vpage] = KEY_FP_NONE;
+	project6_mark_meta_data_dirty(&key_fp[vpage], sizeof(key_fp[vpage]));
+	fp_next[vpage] = FP_CHAIN_END;
+
+	live_keys--;
+}
+
+/**
+ * @brief Spreads the fingerprint into the bits probed in its bloom block
+ *
+ * @param fp Fingerprint of the key
+ *
+ * @return Mixed value, 9 bits are consumed per probe
+ */
+static uint64_t bloom_mix(uint32_t fp)
+{
+	uint64_t h = fp;
+
+	/* MurmurHash3 finalizer */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+/**
+ * @brief Number of bytes used by the bloom filter
+ *
+ * @param num_vpages Number of vpages in the data partition
+ *
+ * @return Size of the bloom filter in bytes
+ */
+uint64_t project6_bloom_bytes(uint64_t num_vpages)
+{
+	uint64_t bytes = num_vpages * BLOOM_BITS_PER_VPAGE / 8;
+
+	if (bytes % BLOOM_BLOCK_BYTES)
+		bytes += BLOOM_BLOCK_BYTES - bytes % BLOOM_BLOCK_BYTES;
+
+	return bytes ? bytes : BLOOM_BLOCK_BYTES;
+}
+
+/**
+ * @brief Adds the fingerprint into the bloom filter
+ *
+ * @param fp Fingerprint of the key
+ */
+void project6_bloom_add(uint32_t fp)
+{
+	uint8_t *block = key_bloom + (fp % bloom_blocks) * BLOOM_BLOCK_BYTES;
+	uint64_t h = bloom_mix(fp);
+	uint32_t bit;
+	int i;
+
+	for (i = 0; i < BLOOM_PROBES; i++) {
+		bit = h & (BLOOM_BLOCK_BYTES * 8 - 1);
+		block[bit / 8] |= 1 << (bit % 8);
+		h >>= 9;
+	}
+
+	project6_mark_meta_data_dirty(block, BLOOM_BLOCK_BYTES);
+}
+
+/**
+ * @brief Checks if the fingerprint may have been stored
+ *
+ * @param fp Fingerprint of the key
+ *
+ * @return false if the key is surely absent, true otherwise
+ */
+bool project6_bloom_may_contain(uint32_t fp)
+{
+	uint8_t *block = key_bloom + (fp % bloom_blocks) * BLOOM_BLOCK_BYTES;
+	uint64_t h = bloom_mix(fp);
+	uint32_t bit;
+	int i;
+
+	for (i = 0; i < BLOOM_PROBES; i++) {
+		bit = h & (BLOOM_BLOCK_BYTES * 8 - 1);
+		if (!(block[bit / 8] & (1 << (bit % 8))))
+			return false;
+		h >>= 9;
+	}
+
+	return true;
+}
+
+/**
+ * @brief Rebuilds the bloom filter from the fingerprints in the index
+ */
+static void bloom_rebuild(void)
+{
+	uint64_t vpage;
+
+	memset(key_bloom, 0, bloom_blocks * BLOOM_BLOCK_BYTES);
+	project6_mark_meta_data_dirty(key_bloom,
+				      bloom_blocks * BLOOM_BLOCK_BYTES);
+
+	for (vpage = 0; vpage < index_vpages; vpage++)
+		if (key_fp[vpage] != KEY_FP_NONE)
+			project6_bloom_add(key_fp[vpage]);
+
+	bloom_stale = 0;
+}
+
+/**
+ * @brief Accounts a deleted key. Bits cannot be cleared from the bloom
+ * filter, so it is rebuilt once deleted keys pile up.
+ */
+void project6_bloom_note_delete(void)
+{
+	bloom_stale++;
+
+	if (bloom_stale > live_keys / 2 + 64)
+		bloom_rebuild();
+}
+
+/**
+ * @brief Finds the next candidate head vpage for a fingerprint
+ *
+ * @param fp Fingerprint of the key being searched
+ * @param vpage PAGE_UNALLOCATED to start a search, otherwise the previous
+ * candidate returned
+ *
+ * @return Next candidate vpage, PAGE_UNALLOCATED when there is none left
+ */
+uint64_t project6_index_next(uint32_t fp, uint64_t vpage)
+{
+	uint32_t cur;
+
+	if (vpage == PAGE_UNALLOCATED)
+		cur = fp_buckets[fp & fp_bucket_mask];
+	else
+		cur = fp_next[vpage];
+
+	while (cur != FP_CHAIN_END) {
+		if (key_fp[cur] == fp)
+			return cur;
+		cur = fp_next[cur];
+	}
+
+	return PAGE_UNALLOCATED;
+}
+
+/**
+ * @brief Releases the index
+ */
+void project6_index_destroy(void)
+{
+	if (fp_buckets)
+		vfree(fp_buckets);
+
+	if (fp_next)
+		vfree(fp_next);
+
+	fp_buckets = NULL;
+	fp_next = NULL;
+}
+
+/**
+ * @brief Builds the bucket chains from the fingerprint array, the bloom
+ * filter is expected to be loaded already
+ *
+ * @param num_vpages Number of vpages covered by the fingerprint array
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_index_init(uint64_t num_vpages)
+{
+	uint64_t num_buckets = 1;
+	uint64_t vpage;
+	uint32_t fp;
+
+	project6_index_destroy();
+
+	if (num_vpages >= FP_CHAIN_END) {
+		printk(PRINT_PREF "Too many vpages for the key index\n");
+		return -EINVAL;
+	}
+
+	while (num_buckets < num_vpages)
+		num_buckets <<= 1;
+
+	fp_bucket_mask = num_buckets - 1;
+
+	fp_buckets = vmalloc(num_buckets * sizeof(uint32_t));
+	fp_next = vmalloc(num_vpages * sizeof(uint32_t));
+
+	if (!fp_buckets || !fp_next) {
+		printk(PRINT_PREF "vmalloc failed for key index\n");
+		project6_index_destroy();
+		return -ENOMEM;
+	}
+
+	memset(fp_buckets, 0xFF, num_buckets * sizeof(uint32_t));
+	memset(fp_next, 0xFF, num_vpages * sizeof(uint32_t));
+
+	index_vpages = num_vpages;
+	live_keys = 0;
+	bloom_stale = 0;
+	bloom_blocks = project6_bloom_bytes(num_vpages) / BLOOM_BLOCK_BYTES;
+
+	for (vpage = 0; vpage < num_vpages; vpage++) {
+		fp = key_fp[vpage];
+
+		if (fp == KEY_FP_NONE)
+			continue;
+
+		fp_next[vpage] = fp_buckets[fp & fp_bucket_mask];
+		fp_buckets[fp & fp_bucket_mask] = vpage;
+		live_keys++;
+	}
+
+	return 0;
+}
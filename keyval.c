@@ -21,11 +21,27 @@
 #include <linux/init.h>
 #include <linux/mtd/mtd.h>
 #include <linux/string.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
 #include "core.h"
 #include "cache.h"
 
 #define PRINT_PREF KERN_INFO "[KEY_VAL]: "
 
+/* Append records at a vpage frontier instead of their hash slot */
+static bool log_mode;
+module_param(log_mode, bool, 0444);
+MODULE_PARM_DESC(log_mode, "Append records at a sequential frontier (default: 0)");
+
+/* Next vpage of the frontier in log mode, saved with the meta-data */
+uint64_t log_vpage = 0;
+
+/* Times a failed write batch is applied again after collecting a block */
+#define BATCH_RETRIES 2
+
+/* Set while a write batch is applied, it must reach the flash as a whole */
+static bool batch_active = false;
+
 /* Taken from http://www.cse.yorku.ca/~oz/hash.html */
 static uint64_t hash(const char *str)
 {
@@ -72,6 +88,9 @@ static int update_data_flash(uint32_t len, const char *buffer, uint64_t *vpage)
 
 		state = project6_get_existing_mapping(++(*vpage), &ppage);
 
+		if (state == PAGE_LOOKUP_ERROR)
+			return -EIO;
+
 		if (state == PAGE_NOT_MAPPED) {
 			printk(PRINT_PREF "Overflow happened for vpage in updating flash\n");
 			return -EPERM;
@@ -94,6 +113,7 @@ static int update_data_flash(uint32_t len, const char *buffer, uint64_t *vpage)
 /**
  * @brief Finds the value for the given key
  *
+ * @param ctx Context holding the head page of the record
  * @param val Pointer of the value to be found
  * @param key_len Length of key which needs to be skipped
  * @param val_len Length of the value to be found
@@ -102,7 +122,7 @@ static int update_data_flash(uint32_t len, const char *buffer, uint64_t *vpage)
  *
  * @return True if found, False if not found
  */
-static bool find_value(char *val, uint32_t key_len,
+static bool find_value(project6_ctx *ctx, char *val, uint32_t key_len,
 	       uint32_t val_len, uint32_t num_pages, uint64_t vpage)
 {
 	uint64_t lpage = vpage;
@@ -114,7 +134,7 @@ static bool find_value(char *val, uint32_t key_len,
 
 	if (num_pages == 1) {
 		memcpy(val,
-		       page_buffer + 16 + key_len, val_len);
+		       ctx->page_buffer + 16 + key_len, val_len);
 		val[val_len] = '\0';
 		return true;
 	} else {
@@ -143,10 +163,10 @@ static bool find_value(char *val, uint32_t key_len,
 
 			if (state == PAGE_VALID) {
 
-				if (read_page(ppage, page_buffer,
+				if (read_page(ppage, ctx->page_buffer,
 					      &data_config) == 0) {
 					memcpy(val + copied,
-					       page_buffer + offset, size);
+					       ctx->page_buffer + offset, size);
 				} else {
 					printk(PRINT_PREF "Reading the page failed in finding key\n");
 				}
@@ -169,6 +189,7 @@ static bool find_value(char *val, uint32_t key_len,
 /**
  * @brief Helper function to compare the key with contents on flash
  *
+ * @param ctx Context holding the head page of the record
  * @param key Key to be searched
  * @param num_pages Number of pages for the key/value
  * @param key_len Length of the key
@@ -176,8 +197,8 @@ static bool find_value(char *val, uint32_t key_len,
  *
  * @return  True if found, False if not found
  */
-static bool find_key(const char *key, uint32_t num_pages,
-	      uint32_t key_len, uint64_t vpage)
+static bool find_key(project6_ctx *ctx, const char *key,
+		     uint32_t num_pages, uint32_t key_len, uint64_t vpage)
 {
 	uint64_t pages = 1;
 	uint32_t size;
@@ -188,12 +209,12 @@ static bool find_key(const char *key, uint32_t num_pages,
 
 	if (key_len <= data_config.page_size - 16) {
 
-		if (!strncmp(key, (page_buffer + 16), key_len)) {
+		if (!strncmp(key, (ctx->page_buffer + 16), key_len)) {
 			return true;
 		}
 	} else {
 
-		if (!strncmp(key, (page_buffer + 16),
+		if (!strncmp(key, (ctx->page_buffer + 16),
 			     data_config.page_size - 16)) {
 
 			key_len = key_len - (data_config.page_size - 16);
@@ -213,11 +234,11 @@ static bool find_key(const char *key, uint32_t num_pages,
 
 				if (state == PAGE_VALID) {
 
-					ret = read_page(ppage, page_buffer,
+					ret = read_page(ppage, ctx->page_buffer,
 						      &data_config);
 					if (!ret) {
 						if (strncmp(key + count,
-							    (page_buffer + 4),
+							    (ctx->page_buffer + 4),
 							    size))
 							return false;
 					} else {
@@ -243,44 +264,64 @@ static bool find_key(const char *key, uint32_t num_pages,
 /**
  * @brief Finds the virtual page for the given key on flash
  *
+ * @param ctx Context of the caller
  * @param key Key to be searched
- * @param vpage Starting vpage given by hash
  * @param ret_page Pointer to the Vpage to be returned
  * @param num_pages Number of pages to be returned
  *
- * @return 0 for success, appropriate failure codes
+ * @return 0 for success, -EIO if the mapper cannot be read, -EINVAL if the
+ * key is not found
  */
-static int get_key_page(const char *key, uint64_t vpage,
+static int get_key_page(project6_ctx *ctx, const char *key,
 		 uint64_t *ret_page, uint32_t *num_pages)
 {
-	size_t counter = 0;
+	uint32_t fp = project6_key_fingerprint(key);
+	uint64_t vpage = PAGE_UNALLOCATED;
 	uint32_t key_len;
 	uint32_t marker;
 	uint64_t ppage;
 	uint8_t state;
+	int slot;
 
-	while (counter <= data_config.nb_blocks * data_config.pages_per_block) {
+	if (!project6_bloom_may_contain(fp))
+		return -EINVAL;
+
+	/* Only the head pages whose fingerprint matches are read */
+	while ((vpage = project6_index_next(fp, vpage)) != PAGE_UNALLOCATED) {
 
 		state = project6_get_existing_mapping(vpage, &ppage);
 
-		if (state == PAGE_NOT_MAPPED) {
-			return -EINVAL;
-		}
+		if (state == PAGE_LOOKUP_ERROR)
+			return -EIO;
+
+		slot = state == PAGE_VALID ?
+			project6_get_vpage_slot(vpage, NULL) : -1;
+
+		if (slot == -EIO)
+			return slot;
+
+		if (slot >= 0) {
+
+			if (!project6_read_packed(ctx, vpage, key, NULL)) {
+				*num_pages = 1;
+				*ret_page = vpage;
+				return 0;
+			}
 
-		if (state == PAGE_VALID) {
+		} else if (state == PAGE_VALID) {
 
-			if (read_page(ppage, page_buffer, &data_config) == 0) {
+			if (read_page(ppage, ctx->page_buffer, &data_config) == 0) {
 
-				marker = *((uint32_t *)page_buffer);
+				marker = *((uint32_t *)ctx->page_buffer);
 
 				if (marker & NEW_KEY) {
 					*num_pages =
-						*((uint32_t *)(page_buffer+4));
+						*((uint32_t *)(ctx->page_buffer+4));
 					key_len = strlen(key);
 
 					if ((key_len ==
-					    *((uint32_t *)(page_buffer + 8))) &&
-					    find_key(key, *num_pages,
+					    *((uint32_t *)(ctx->page_buffer + 8))) &&
+					    find_key(ctx, key, *num_pages,
 						     key_len, vpage)) {
 						*ret_page = vpage;
 						return 0;
@@ -290,10 +331,6 @@ static int get_key_page(const char *key, uint64_t vpage,
 			}
 
 		}
-
-		vpage = (vpage + 1) % (data_config.nb_blocks *
-				       data_config.pages_per_block);
-		counter++;
 	}
 	return -EINVAL;
 }
@@ -324,7 +361,8 @@ static int update_key_value_to_flash(const char *key,
 	uint64_t ppage;
 	int ret = 0;
 
-	project6_get_existing_mapping(vpage, &ppage);
+	if (project6_get_existing_mapping(vpage, &ppage) == PAGE_LOOKUP_ERROR)
+		return -EIO;
 
 	/* prepare the buffer we are going to write on flash */
 	memset(page_buffer, 0x0, data_config.page_size);
@@ -424,7 +462,9 @@ static int update_key_value_to_flash(const char *key,
 			val_len -= size;
 			val_count += size;
 
-			project6_get_existing_mapping(++vpage, &ppage);
+			if (project6_get_existing_mapping(++vpage, &ppage) ==
+			    PAGE_LOOKUP_ERROR)
+				return -EIO;
 
 			ret = write_page(ppage, page_buffer, &data_config);
 
@@ -450,43 +490,185 @@ static int update_key_value_to_flash(const char *key,
 }
 
 /**
- * @brief Performs set/update of key
+ * @brief Position of a key in a multi-get, ordered by the page to read
+ */
+struct mget_order {
+	uint64_t ppage;
+	int index;
+};
+
+/**
+ * @brief Compares two keys of a multi-get by their head page
+ */
+static int mget_order_cmp(const void *a, const void *b)
+{
+	const struct mget_order *x = a;
+	const struct mget_order *y = b;
+
+	if (x->ppage != y->ppage)
+		return x->ppage < y->ppage ? -1 : 1;
+
+	return x->index - y->index;
+}
+
+/**
+ * @brief Finds the page holding the head of the key without reading flash
+ *
+ * @param key Key to be located
+ *
+ * @return Ppage of the first candidate, 0 for cached keys and
+ * PAGE_UNALLOCATED for absent keys
+ */
+static uint64_t locate_key_page(const char *key)
+{
+	uint32_t fp = project6_key_fingerprint(key);
+	uint64_t vpage = PAGE_UNALLOCATED;
+	uint64_t ppage;
+	uint32_t num_pages;
+
+	if (project6_cache_lookup(key, NULL, &vpage, &num_pages))
+		return 0;
+
+	if (!project6_bloom_may_contain(fp))
+		return PAGE_UNALLOCATED;
+
+	while ((vpage = project6_index_next(fp, vpage)) != PAGE_UNALLOCATED)
+		if (project6_get_existing_mapping(vpage, &ppage) == PAGE_VALID)
+			return ppage;
+
+	return PAGE_UNALLOCATED;
+}
+
+/**
+ * @brief Orders the keys of a multi-get by the physical page holding them,
+ * so that records sharing a page or contiguous pages are read together
+ *
+ * @param keys Keys to be read
+ * @param order Filled with the indexes of the keys in reading order
+ * @param count Number of keys
+ *
+ * @return 0 on success, -ENOMEM on failure, -ERESTARTSYS if a signal
+ * interrupted the wait for the mount
+ */
+int mget_order_keys(const char **keys, int *order, int count)
+{
+	struct mget_order *pos;
+	int ret;
+	int i;
+
+	pos = vmalloc(count * sizeof(struct mget_order));
+
+	if (!pos)
+		return -ENOMEM;
+
+	ret = project6_wait_mounted();
+
+	if (ret) {
+		vfree(pos);
+		return ret;
+	}
+
+	down_read(&kv_sem);
+
+	for (i = 0; i < count; i++) {
+		pos[i].ppage = locate_key_page(keys[i]);
+		pos[i].index = i;
+	}
+
+	up_read(&kv_sem);
+
+	sort(pos, count, sizeof(struct mget_order), mget_order_cmp, NULL);
+
+	for (i = 0; i < count; i++)
+		order[i] = pos[i].index;
+
+	vfree(pos);
+
+	return 0;
+}
+
+/**
+ * @brief Runs the garbage collection and the periodic meta-data flush
+ * before a write, unless a write batch is being applied
+ */
+static void write_housekeeping(void)
+{
+	if (batch_active)
+		return;
+
+	project6_gc_balance();
+
+	project6_flush_meta_data_timely();
+}
+
+/**
+ * @brief Number of vpages used by a record
+ *
+ * @param key_len Length of the key
+ * @param val_len Length of the value
+ *
+ * @return Number of vpages
+ */
+static uint32_t record_num_pages(uint32_t key_len, uint32_t val_len)
+{
+	if (project6_is_packed_record(key_len, val_len))
+		return 1;
+	else if ((12 + key_len + val_len) % (data_config.page_size - 4) == 0)
+		return (12 + key_len + val_len) /
+			(data_config.page_size - 4);
+	else
+		return (12 + key_len + val_len) /
+			(data_config.page_size - 4) + 1;
+}
+
+/**
+ * @brief Moves the log frontier past a record which was just written
+ *
+ * @param vpage First vpage of the record
+ * @param num_pages Number of vpages of the record
+ */
+static void log_advance(uint64_t vpage, uint32_t num_pages)
+{
+	if (log_mode)
+		log_vpage = (vpage + num_pages) % (data_config.nb_blocks *
+						   data_config.pages_per_block);
+}
+
+/**
+ * @brief Performs set/update of key, kv_sem is held for write
  *
  * @param key Key to be updated/set
  * @param val Value for the given key
  *
  * @return 0 for success, -1 for failure
  */
-int set_keyval(const char *key, const char *val)
+static int __set_keyval(const char *key, const char *val)
 {
 	uint64_t vpage;
 	uint64_t ppage;
 	uint64_t lpage;
+	uint64_t start;
 	size_t counter = 0;
 	int ret = 0;
 	int key_len;
 	int val_len;
 	uint8_t state;
 	uint32_t num_pages = 0;
+	uint32_t fp = project6_key_fingerprint(key);
+	bool packed;
 
-	if (total_written_page >
-	    (data_config.nb_blocks * data_config.pages_per_block) / 2) {
-
-		if (project6_garbage_collection(2)) {
-			printk(PRINT_PREF "garbage collection has failed\n");
-		}
-	}
-
-	project6_flush_meta_data_timely();
+	write_housekeeping();
 
 	if (!project6_cache_lookup(key, NULL, &vpage, &num_pages)) {
 
 		vpage = hash(key);
 
-		ret = get_key_page(key, vpage, &lpage, &num_pages);
+		ret = get_key_page(writer_ctx, key, &lpage, &num_pages);
 
 		if (!ret) {
 
+			project6_index_remove(lpage);
+
 			ret = project6_mark_vpage_invalid(lpage, num_pages);
 
 			if (ret) {
@@ -495,6 +677,8 @@ int set_keyval(const char *key, const char *val)
 			}
 		}
 	} else {
+		project6_index_remove(vpage);
+
 		ret = project6_mark_vpage_invalid(vpage, num_pages);
 
 		if (ret) {
@@ -503,23 +687,50 @@ int set_keyval(const char *key, const char *val)
 		}
 	}
 
+	/* The old record may still be live, a second one must not be set */
+	if (ret == -EIO)
+		goto fail;
+
 	key_len = strlen(key);
 
 	val_len = strlen(val);
 
-	if ((12 + key_len + val_len) % (data_config.page_size - 4) == 0)
-		num_pages = (12 + key_len + val_len) /
-			(data_config.page_size - 4);
-	else
-		num_pages = (12 + key_len + val_len) /
-			(data_config.page_size - 4) + 1;
+	packed = project6_is_packed_record(key_len, val_len);
+
+	num_pages = record_num_pages(key_len, val_len);
 
+	/* The key index alone locates the records in log mode, so they
+	 * are appended at the frontier where vpages are normally free */
+	if (log_mode)
+		vpage = log_vpage;
 
+	start = vpage;
+retry:
 	while (counter <= data_config.nb_blocks * data_config.pages_per_block) {
 
 		state = project6_get_existing_mapping(vpage, &ppage);
 
-		if (state == PAGE_NOT_MAPPED || state == PAGE_RECLAIMED) {
+		if (state == PAGE_LOOKUP_ERROR) {
+			printk(PRINT_PREF "Mapper cannot be read for set \n");
+			goto fail;
+		}
+
+		if (packed &&
+		    (state == PAGE_NOT_MAPPED || state == PAGE_RECLAIMED)) {
+
+			ret = project6_pack_record(vpage, key, key_len,
+						   val, val_len);
+			if (ret) {
+				printk(PRINT_PREF "Packing the record failed for set \n");
+				goto fail;
+			}
+
+			project6_cache_update(key, val, vpage, num_pages);
+			project6_index_insert(vpage, fp);
+			log_advance(vpage, num_pages);
+			return 0;
+
+		} else if (state == PAGE_NOT_MAPPED || state == PAGE_RECLAIMED) {
 
 			ret = project6_create_mapping_multipage(vpage,
 								num_pages);
@@ -536,10 +747,16 @@ int set_keyval(const char *key, const char *val)
 					printk(PRINT_PREF "Update to flash failed for set \n");
 					goto fail;
 				}
+
+				project6_index_insert(vpage, fp);
+				log_advance(vpage, num_pages);
 				return 0;
 			} else if (ret == -ENOMEM) {
 				printk(PRINT_PREF "No memory to perform mapping \n");
 				goto fail;
+			} else if (ret == -EIO) {
+				printk(PRINT_PREF "Mapper cannot be updated for set \n");
+				goto fail;
 			}
 		}
 
@@ -548,6 +765,14 @@ int set_keyval(const char *key, const char *val)
 		counter++;
 	}
 
+	/* Deleted records hold their vpages until their block is collected,
+	 * the writer waits for one more block when the collector lags behind */
+	if (!batch_active && project6_gc_collect_one() == 0) {
+		vpage = start;
+		counter = 0;
+		goto retry;
+	}
+
 	printk(PRINT_PREF "Set key failed as no space was found\n");
 fail:
 	project6_cache_remove(key);
@@ -555,35 +780,53 @@ fail:
 }
 
 /**
- * @brief Deletes the given key
+ * @brief Performs set/update of key
+ *
+ * @param key Key to be updated/set
+ * @param val Value for the given key
+ *
+ * @return 0 for success, -ERESTARTSYS if a signal interrupted the wait for
+ * the mount, -1 for other failures
+ */
+int set_keyval(const char *key, const char *val)
+{
+	int ret;
+
+	ret = project6_wait_mounted();
+
+	if (ret)
+		return ret;
+
+	down_write(&kv_sem);
+	ret = __set_keyval(key, val);
+	up_write(&kv_sem);
+
+	return ret;
+}
+
+/**
+ * @brief Deletes the given key, kv_sem is held for write
  *
  * @param key String for the key
  *
- * @return 0 on success, -1 for failure
+ * @return 0 on success, -EIO if the mapper cannot be read, -1 for other
+ * failures
  */
-int del_keyval(const char *key)
+static int __del_keyval(const char *key)
 {
 	int ret = 0;
 	uint64_t vpage;
 	uint64_t lpage;
 	uint32_t num_pages = 0;
 
-	if (total_written_page >
-	    (data_config.nb_blocks * data_config.pages_per_block) / 2) {
-
-		if (project6_garbage_collection(2)) {
-			printk(PRINT_PREF "garbage collection has failed\n");
-		}
-	}
-
-	project6_flush_meta_data_timely();
+	write_housekeeping();
 
 	if (!project6_cache_lookup(key, NULL, &vpage, &num_pages)) {
-		vpage = hash(key);
-
-		ret = get_key_page(key, vpage, &lpage, &num_pages);
+		ret = get_key_page(writer_ctx, key, &lpage, &num_pages);
 
 		if (!ret) {
+			project6_index_remove(lpage);
+
 			ret = project6_mark_vpage_invalid(lpage, num_pages);
 
 			if (ret) {
@@ -595,6 +838,8 @@ int del_keyval(const char *key)
 			printk("No pages were found \n");
 		}
 	} else {
+		project6_index_remove(vpage);
+
 		ret = project6_mark_vpage_invalid(vpage, num_pages);
 		if (ret) {
 			printk(PRINT_PREF "Mark invalid failed for 0x%llx num %d\n",
@@ -604,68 +849,114 @@ int del_keyval(const char *key)
 	}
 	if (ret) {
 		printk(PRINT_PREF "Could not delete key \n");
-		return -1;
+		return ret == -EIO ? ret : -1;
 	}
 
+	project6_bloom_note_delete();
+
 	return 0;
 }
 
 /**
- * @brief Gets the value for given key
+ * @brief Deletes the given key
+ *
+ * @param key String for the key
  *
+ * @return 0 on success, -EIO if the mapper cannot be read, -ERESTARTSYS
+ * if a signal interrupted the wait for the mount, -1 for other failures
+ */
+int del_keyval(const char *key)
+{
+	int ret;
+
+	ret = project6_wait_mounted();
+
+	if (ret)
+		return ret;
+
+	down_write(&kv_sem);
+	ret = __del_keyval(key);
+	up_write(&kv_sem);
+
+	return ret;
+}
+
+/**
+ * @brief Gets the value for given key, kv_sem is held for read
+ *
+ * @param ctx Context of the caller
  * @param key Key to be searched
  * @param val Pointer for the value
  *
  * @return 0 for success, -1 for failure
  */
-int get_keyval(const char *key, char *val)
+static int __get_keyval(project6_ctx *ctx, const char *key, char *val)
 {
-	uint64_t vpage;
+	uint64_t vpage = PAGE_UNALLOCATED;
 	uint64_t ppage;
-	size_t counter = 0;
 	uint32_t marker;
 	uint32_t key_len;
 	uint32_t val_len;
 	uint32_t num_pages;
+	uint32_t fp;
 	uint8_t state;
+	int slot;
 	int ret;
 
-	project6_flush_meta_data_timely();
-
 	if (project6_cache_lookup(key, val, &vpage, &num_pages)) {
 		return 0;
 	}
 
-	vpage = hash(key);
+	fp = project6_key_fingerprint(key);
 
-	while (counter <= data_config.nb_blocks * data_config.pages_per_block) {
+	if (!project6_bloom_may_contain(fp))
+		return -1;
+
+	/* A miss costs no flash read unless a fingerprint collides */
+	while ((vpage = project6_index_next(fp, vpage)) != PAGE_UNALLOCATED) {
 
 		state = project6_get_existing_mapping(vpage, &ppage);
 
-		if (state == PAGE_NOT_MAPPED) {
+		if (state == PAGE_LOOKUP_ERROR) {
+			printk(PRINT_PREF "Mapper cannot be read in get key\n");
 			return -1;
 		}
 
-		if (state == PAGE_VALID) {
-			ret = read_page(ppage, page_buffer, &data_config);
+		slot = state == PAGE_VALID ?
+			project6_get_vpage_slot(vpage, NULL) : -1;
+
+		if (slot == -EIO) {
+			printk(PRINT_PREF "Mapper cannot be read in get key\n");
+			return -1;
+		}
+
+		if (slot >= 0) {
+
+			if (!project6_read_packed(ctx, vpage, key, val)) {
+				project6_cache_add(key, val, vpage, 1);
+				return 0;
+			}
+
+		} else if (state == PAGE_VALID) {
+			ret = read_page(ppage, ctx->page_buffer, &data_config);
 			if (ret) {
 				printk(PRINT_PREF "Reading page has failed in get key\n");
 				return -1;
 			}
 
-			marker = *((uint32_t *)page_buffer);
+			marker = *((uint32_t *)ctx->page_buffer);
 
 			if (marker & NEW_KEY) {
 				key_len = strlen(key);
-				val_len = *((uint32_t *)(page_buffer + 12));
-				num_pages = *((uint32_t *)(page_buffer + 4));
+				val_len = *((uint32_t *)(ctx->page_buffer + 12));
+				num_pages = *((uint32_t *)(ctx->page_buffer + 4));
 
-				if (key_len == *((uint32_t *)(page_buffer + 8)))
+				if (key_len == *((uint32_t *)(ctx->page_buffer + 8)))
 				{
 
-					if (find_key(key, num_pages, key_len,
+					if (find_key(ctx, key, num_pages, key_len,
 						     vpage)) {
-						if (!find_value(val, key_len,
+						if (!find_value(ctx, val, key_len,
 								val_len, num_pages, vpage)) {
 							printk(PRINT_PREF "Get key failed as value was not found on flash\n");
 							return -1;
@@ -678,11 +969,161 @@ int get_keyval(const char *key, char *val)
 				}
 			}
 		}
-		vpage = (vpage + 1) % (data_config.nb_blocks *
-				       data_config.pages_per_block);
-		counter++;
 	}
 
-	printk(PRINT_PREF "Get key failed as pages exhausted\n");
 	return -1;
 }
+
+/**
+ * @brief Gets the value for given key
+ *
+ * @param ctx Context of the caller
+ * @param key Key to be searched
+ * @param val Pointer for the value
+ *
+ * @return 0 for success, -ERESTARTSYS if a signal interrupted the wait for
+ * the mount, -1 for other failures
+ */
+int get_keyval(project6_ctx *ctx, const char *key, char *val)
+{
+	int ret;
+
+	ret = project6_wait_mounted();
+
+	if (ret)
+		return ret;
+
+	/* Lookups do not modify the meta-data, flushing needs the writers out */
+	if (project6_meta_data_flush_due()) {
+		down_write(&kv_sem);
+		project6_flush_meta_data_timely();
+		up_write(&kv_sem);
+	}
+
+	down_read(&kv_sem);
+	ret = __get_keyval(ctx, key, val);
+	up_read(&kv_sem);
+
+	return ret;
+}
+
+/**
+ * @brief Applies several sets and deletes as one unit. The batch reaches
+ * the meta-data partition in a single flush, a crash before it leaves
+ * none of its operations visible.
+ *
+ * @param count Number of operations
+ * @param keys Keys of the operations
+ * @param vals Values of the sets, NULL for a delete
+ * @param status Filled with the return code of each operation
+ *
+ * @return 0 on success, -ENOSPC if the batch cannot fit, -1 if it failed
+ * and was rolled back, -ERESTARTSYS if a signal interrupted the wait for the
+ * mount
+ */
+int write_batch(int count, const char **keys, const char **vals, int *status)
+{
+	uint64_t needed = 0;
+	uint64_t needed_vpages = 0;
+	uint32_t key_len;
+	uint32_t val_len;
+	int retries = BATCH_RETRIES;
+	int ret;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		status[i] = -1;
+
+		if (!vals[i])
+			continue;
+
+		key_len = strlen(keys[i]);
+		val_len = strlen(vals[i]);
+
+		needed_vpages += record_num_pages(key_len, val_len);
+
+		if (!project6_is_packed_record(key_len, val_len))
+			needed += record_num_pages(key_len, val_len);
+	}
+
+	/* Packed records share pages */
+	needed += project6_pack_pages_needed(count, keys, vals);
+
+	ret = project6_wait_mounted();
+
+	if (ret)
+		return ret;
+
+	down_write(&kv_sem);
+
+	write_housekeeping();
+
+retry:
+	/* No garbage can be collected once the batch started */
+	while (needed > project6_count_free_pages() ||
+	       needed_vpages > project6_count_free_vpages()) {
+		if (project6_gc_collect_one()) {
+			printk(PRINT_PREF "Not enough free pages for the batch\n");
+			up_write(&kv_sem);
+			return -ENOSPC;
+		}
+	}
+
+	/* The state before the batch is what a rollback goes back to */
+	project6_flush_meta_data_if_dirty();
+
+	batch_active = true;
+	ret = 0;
+
+	for (i = 0; i < count; i++) {
+		if (vals[i]) {
+			status[i] = __set_keyval(keys[i], vals[i]);
+			if (status[i]) {
+				ret = -1;
+				break;
+			}
+		} else {
+			/* Deleting a missing key does not fail the batch */
+			status[i] = __del_keyval(keys[i]);
+			if (status[i] == -EIO) {
+				ret = -1;
+				break;
+			}
+		}
+	}
+
+	batch_active = false;
+
+	/* The last packed records must be on flash before the commit */
+	if (!ret && project6_pack_seal())
+		ret = -1;
+
+	if (ret) {
+		printk(PRINT_PREF "Write batch failed, rolling back\n");
+
+		for (i = 0; i < count; i++)
+			status[i] = -1;
+
+		project6_cache_clean();
+
+		if (project6_reload_meta_data()) {
+			printk(PRINT_PREF "Rollback of the write batch failed\n");
+			up_write(&kv_sem);
+			return ret;
+		}
+
+		/* The records may not have found contiguous vpages, which
+		 * the vpages of deleted records give back once collected */
+		if (retries-- > 0 && project6_gc_collect_one() == 0)
+			goto retry;
+
+		up_write(&kv_sem);
+		return ret;
+	}
+
+	project6_flush_meta_data_to_flash(&meta_config);
+
+	up_write(&kv_sem);
+
+	return 0;
+}
@@ -21,57 +21,1695 @@
 #include <linux/init.h>
 #include <linux/mtd/mtd.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
 #include <linux/string.h>
 #include <linux/jiffies.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
 #include "core.h"
 
 uint8_t *bitmap = NULL;
-uint64_t *mapper = NULL;
 
-static uint64_t bitmap_start = 0x1;
-static uint64_t bitmap_pages;
+/* Whole mapper, NULL when its pages are cached */
+static void *mapper = NULL;
 
-static uint64_t mapper_start;
-static uint64_t mapper_pages;
+/**
+ * @brief An in memory array which is mirrored in the meta-data partition
+ */
+struct meta_region {
+	void **mem;		/* in memory copy */
+	uint64_t bytes;		/* bytes used by the copy */
+	uint8_t fill;		/* byte pattern of a freshly formatted copy */
+	uint64_t lpage;		/* first logical meta-data page */
+	uint64_t pages;		/* pages used in the meta-data partition */
+};
+
+/* Regions are numbered in this order in the logical meta-data pages */
+static struct meta_region regions[] = {
+	{ .mem = (void **)&bitmap, .fill = 0xFF },
+	{ .mem = (void **)&mapper, .fill = 0xFF },
+	{ .mem = (void **)&key_fp, .fill = 0x00 },
+	{ .mem = (void **)&key_bloom, .fill = 0x00 },
+	{ .mem = (void **)&block_info, .fill = 0x00 },
+};
+
+#define NUM_META_REGIONS (sizeof(regions) / sizeof(regions[0]))
+
+#define MAPPER_REGION 1
+
+/*
+ * The mapper stores 32 bits entries when the ppages and the slots of the
+ * packed records fit: the slot + 1 goes right above the ppage bits, and two
+ * values out of reach of the slots are kept for the sentinels. Larger data
+ * partitions store the 64 bits entries as they are in memory.
+ */
+#define MAPPER_SLOT_BITS 7
+#define MAPPER32_UNALLOCATED 0xFFFFFFFF
+#define MAPPER32_RECLAIMED 0xFFFFFFFE
+
+/* Bytes of a stored mapper entry */
+static uint32_t mapper_entry_bytes;
+
+/* Position of the slot in a 32 bits entry */
+static uint32_t mapper_slot_shift;
+
+/*
+ * Layout of the meta-data partition:
+ *
+ * The regions are cut in logical pages which are written out of place, only
+ * the modified ones at each flush. Directory pages map the logical pages to
+ * their current page in the partition, and a root page written last maps the
+ * directory pages. The root is the commit point of a flush.
+ *
+ * The blocks are filled one after the other, each one starts with a header
+ * carrying a sequence number. Mount takes the newest root of the newest
+ * block holding one. A block is erased again only once the last committed
+ * root does not refer to any of its pages.
+ */
+#define META_ROOT_MAGIC 0xdeadbeef
+#define META_BLOCK_MAGIC 0xfeedface
+
+/* No page of the meta-data partition */
+#define META_NONE 0xFFFFFFFF
+
+/* Attempts to write a meta-data page before the flush gives up */
+#define META_WRITE_TRIES 3
+
+/**
+ * @brief First page of each block of the meta-data partition
+ */
+struct meta_block_header {
+	uint32_t magic;
+	uint32_t checksum;	/* of the fields after this one */
+	uint64_t seq;		/* sequence number when the block was opened */
+};
+
+/**
+ * @brief Root page, committing a flush
+ */
+struct meta_root {
+	uint32_t magic;
+	uint32_t checksum;	/* of the fields after this one */
+	uint64_t seq;		/* sequence number of the flush */
+	uint64_t total_written_page;
+	uint64_t log_vpage;	/* frontier of the log mode */
+	uint32_t lpages;	/* logical meta-data pages */
+	uint32_t dir_pages;	/* directory pages */
+	uint32_t dir[];		/* page of each directory page */
+};
+
+/* Logical meta-data pages, and the directory pages mapping them */
+static uint64_t meta_lpages;
+static uint64_t meta_dir_pages;
+
+/* Logical pages mapped by one directory page */
+static uint64_t dir_entries;
+
+/* Current page of each logical page, of each directory page and the root */
+static uint32_t *lpage_map = NULL;
+static uint32_t *dir_map = NULL;
+static uint32_t root_ppage = META_NONE;
+
+/* Logical pages modified since the last root */
+static uint8_t *lpage_dirty = NULL;
+
+/* Directory pages to be written again to free their block */
+static uint8_t *dir_dirty = NULL;
+
+/* Pages written by the flush in progress, committed with the root */
+static uint32_t *lpage_pending = NULL;
+static uint32_t *dir_pending = NULL;
+
+/*
+ * Pages of each block the last root refers to. Blocks with none left when a
+ * flush starts can be erased and written again by this flush.
+ */
+static uint32_t *meta_live = NULL;
+static uint8_t *meta_reusable = NULL;
+static uint8_t *meta_erased = NULL;
+
+/* Blocks whose erase failed, never written again */
+static uint8_t *meta_bad = NULL;
+
+/* Block erased ahead by the flusher thread, META_NONE if none */
+static uint32_t meta_erasing = META_NONE;
+
+/* Scratch counts used to pick the blocks to be cleaned */
+static uint32_t *meta_rewrite = NULL;
+
+/* Next page to be written, META_NONE when no block is open */
+static uint32_t meta_head = META_NONE;
+
+/* Sequence number of the last block header or root written */
+static uint64_t meta_seq;
+
+/* Buffer for the directory pages and root */
+static uint8_t *meta_buffer = NULL;
+
+/* Block headers are written while meta_buffer holds the page to follow */
+static uint8_t *header_buffer = NULL;
+
+/* Sequence number of each block header read at mount, 0 if none */
+static uint64_t *block_seq = NULL;
+
+/* Sequence number of the last root */
+static uint64_t root_seq;
+
+/* Modifications since the last flush */
+static uint64_t meta_changes;
+
+/*
+ * Journal: between two roots, a flush only appends the byte ranges modified
+ * since the previous flush to journal pages. Mount replays the flushes
+ * journaled after the last root, and a new root is written, folding the
+ * journal, once it is full or a modification is too large for it.
+ */
+static unsigned int meta_journal_pages = 32;
+module_param(meta_journal_pages, uint, 0444);
+MODULE_PARM_DESC(meta_journal_pages, "Journal pages written between two meta-data roots, 0 disables the journal (default: 32)");
+
+#define META_JOURNAL_MAGIC 0xabadcafe
+
+/* Larger modifications are written by the next root */
+#define JOURNAL_MAX_RANGE 256
+
+/**
+ * @brief Journal page, all the pages of a flush are replayed or none
+ */
+struct meta_journal_page {
+	uint32_t magic;
+	uint32_t checksum;	/* of the fields after this one and the records */
+	uint64_t root_seq;	/* root the records apply to */
+	uint64_t flush_seq;	/* flush the page belongs to */
+	uint64_t total_written_page;
+	uint64_t log_vpage;	/* frontier of the log mode */
+	uint32_t index;		/* page of the flush */
+	uint32_t count;		/* pages written by the flush */
+	uint32_t bytes;		/* bytes of records */
+	uint32_t pad;
+	uint8_t records[];	/* meta_journal_record and data, in order */
+};
+
+/**
+ * @brief Byte range of the logical pages, in memory and in a journal page
+ */
+struct meta_journal_record {
+	uint32_t offset;	/* from the start of the first logical page */
+	uint32_t len;
+};
+
+/* Ranges modified since the last flush */
+static struct meta_journal_record *journal_ranges = NULL;
+static uint64_t journal_nr_ranges;
+static uint64_t journal_max_ranges;
+
+/* A modification could not be journaled, the next flush writes a root */
+static bool journal_full;
+
+/* Journal pages allowed after a root, and written since the last one */
+static uint64_t journal_limit;
+static uint64_t journal_written;
+
+/* Journal pages of the last root held in each block */
+static uint32_t *journal_live = NULL;
+
+/* Pages written by the journal flush in progress */
+static uint32_t *journal_flush_pages = NULL;
+
+/* Jiffies for controlling the meta-data flush */
+static unsigned long old_meta_jiffies = 0;
+
+/*
+ * The flusher thread writes the meta-data every meta_flush_ms, or earlier
+ * once meta_flush_changes modifications piled up. Without the thread the
+ * requests flush it by themselves.
+ */
+static unsigned int meta_flush_ms = 333;
+module_param(meta_flush_ms, uint, 0444);
+MODULE_PARM_DESC(meta_flush_ms, "Interval of the meta-data flush in milliseconds (default: 333)");
+
+static unsigned int meta_flush_changes = 1024;
+module_param(meta_flush_changes, uint, 0444);
+MODULE_PARM_DESC(meta_flush_changes, "Meta-data modifications waking up the flusher before the interval, 0 disables it (default: 1024)");
+
+static struct task_struct *flush_thread = NULL;
+static DECLARE_WAIT_QUEUE_HEAD(flush_wait);
+static atomic_t flush_kicked = ATOMIC_INIT(0);
+
+/*
+ * Mapper cache: the mapper takes 4 or 8 bytes per data page, which does not
+ * fit in memory for a large flash. With mapper_cache_pages set, only that many
+ * pages of the mapper are kept. The others are read from the partition when
+ * needed, in place of the least recently used clean page. A modified page
+ * stays until a root writes it back, and the writers flush once half of
+ * the cache is modified. The cache grows past its size rather than failing
+ * when only modified pages are left. Only the mapper is bounded, the other
+ * per page arrays (bitmap, key fingerprints, reverse map, live slots) stay
+ * in memory.
+ */
+static unsigned int mapper_cache_pages = 0;
+module_param(mapper_cache_pages, uint, 0444);
+MODULE_PARM_DESC(mapper_cache_pages, "Mapper pages kept in memory, 0 keeps the whole mapper, the other per page arrays stay in memory (default: 0)");
+
+/* No page of the mapper */
+#define MAPPER_NO_PAGE U64_MAX
+
+/**
+ * @brief Page of the mapper in the cache
+ */
+struct mapper_slot {
+	struct list_head lru;
+	uint64_t page;		/* page of the mapper, MAPPER_NO_PAGE if none */
+	bool dirty;		/* modified since the last root */
+	uint8_t *data;
+};
+
+/* Slots, the most recently used first */
+static LIST_HEAD(mapper_lru);
+
+/* Slot of each page of the mapper, NULL if it is not cached */
+static struct mapper_slot **mapper_slots = NULL;
+static uint64_t mapper_nr_slots;
+static uint64_t mapper_dirty;
+
+/* The lookups fault the pages in concurrently under kv_sem, and the flusher
+ * thread writes them back under kv_sem held for read as well. It guards the
+ * slots and lpage_map, which the lookups read the pages from */
+static DEFINE_MUTEX(mapper_lock);
+
+#define PRINT_PREF KERN_INFO "META-DATA "
+
+/**
+ * @brief Number of pages needed to store the given bytes
+ *
+ * @param bytes Number of bytes
+ * @param page_size Size of the page
+ *
+ * @return Number of pages
+ */
+static uint64_t bytes_to_pages(uint64_t bytes, int page_size)
+{
+	if (bytes % page_size == 0)
+		return bytes / page_size;
+	else
+		return bytes / page_size + 1;
+}
+
+/**
+ * @brief Checksums a meta-data structure, Fowler-Noll-Vo 1a
+ *
+ * @param buf First byte covered
+ * @param len Number of bytes covered
+ *
+ * @return Checksum
+ */
+static uint32_t meta_checksum(const uint8_t *buf, size_t len)
+{
+	uint32_t sum = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sum = (sum ^ buf[i]) * 16777619u;
+
+	return sum;
+}
+
+/**
+ * @brief Checks the magic and checksum of a header or root read in
+ * meta_buffer
+ *
+ * @param magic Expected magic
+ * @param len Bytes of the structure
+ *
+ * @return true if the structure is intact
+ */
+static bool meta_check(uint32_t magic, size_t len)
+{
+	uint32_t *words = (uint32_t *)meta_buffer;
+
+	if (len > meta_config.page_size || words[0] != magic)
+		return false;
+
+	return words[1] == meta_checksum(meta_buffer + 8, len - 8);
+}
+
+/**
+ * @brief Bytes of a root mapping the given directory pages
+ *
+ * @param dir_pages Number of directory pages
+ *
+ * @return Size of the root
+ */
+static size_t root_bytes(uint64_t dir_pages)
+{
+	return sizeof(struct meta_root) + dir_pages * sizeof(uint32_t);
+}
+
+/**
+ * @brief Orders two journal ranges by offset
+ */
+static int journal_range_cmp(const void *a, const void *b)
+{
+	const struct meta_journal_record *x = a;
+	const struct meta_journal_record *y = b;
+
+	if (x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
+
+	return 0;
+}
+
+/**
+ * @brief Sorts the journal ranges and merges the ones overlapping or close
+ * enough that a single record is shorter
+ */
+static void journal_compact(void)
+{
+	struct meta_journal_record *last;
+	struct meta_journal_record *range;
+	uint64_t count = 0;
+	uint64_t i;
+
+	if (!journal_nr_ranges)
+		return;
+
+	sort(journal_ranges, journal_nr_ranges,
+	     sizeof(struct meta_journal_record), journal_range_cmp, NULL);
+
+	for (i = 0; i < journal_nr_ranges; i++) {
+		range = &journal_ranges[i];
+
+		if (count) {
+			last = &journal_ranges[count - 1];
+
+			if (range->offset <= last->offset + last->len +
+			    sizeof(struct meta_journal_record)) {
+				last->len = max(last->offset + last->len,
+						range->offset + range->len) -
+					last->offset;
+				continue;
+			}
+		}
+
+		journal_ranges[count++] = *range;
+	}
+
+	journal_nr_ranges = count;
+}
+
+/**
+ * @brief Records a modified range for the next journal flush
+ *
+ * @param offset Offset of the range from the first logical page
+ * @param len Bytes of the range
+ */
+static void journal_add(uint64_t offset, size_t len)
+{
+	struct meta_journal_record *last;
+
+	if (journal_full || !len)
+		return;
+
+	if (len > JOURNAL_MAX_RANGE) {
+		journal_full = true;
+		return;
+	}
+
+	/* The same entry is often modified a few times in a row */
+	if (journal_nr_ranges) {
+		last = &journal_ranges[journal_nr_ranges - 1];
+
+		if (last->offset == offset && last->len == len)
+			return;
+	}
+
+	if (journal_nr_ranges == journal_max_ranges)
+		journal_compact();
+
+	if (journal_nr_ranges == journal_max_ranges) {
+		journal_full = true;
+		return;
+	}
+
+	journal_ranges[journal_nr_ranges].offset = offset;
+	journal_ranges[journal_nr_ranges].len = len;
+	journal_nr_ranges++;
+}
+
+/**
+ * @brief Marks the logical pages covering a range of a region as modified
+ *
+ * @param region Region modified
+ * @param offset Offset of the first byte modified in the region
+ * @param len Number of bytes modified
+ */
+static void meta_mark_range(struct meta_region *region, uint64_t offset,
+			    size_t len)
+{
+	uint64_t page = offset / meta_config.page_size;
+	uint64_t last = (offset + len - 1) / meta_config.page_size;
+
+	journal_add(region->lpage * meta_config.page_size + offset, len);
+	meta_changes++;
+
+	for (; page <= last; page++)
+		lpage_dirty[region->lpage + page] = 1;
+}
+
+/**
+ * @brief Marks the logical pages covering a range of a region as modified
+ *
+ * @param addr First byte modified
+ * @param len Number of bytes modified
+ */
+void project6_mark_meta_data_dirty(const void *addr, size_t len)
+{
+	const uint8_t *byte = addr;
+	const uint8_t *mem;
+	size_t i;
+
+	if (!lpage_dirty)
+		return;
+
+	for (i = 0; i < NUM_META_REGIONS; i++) {
+		mem = *regions[i].mem;
+
+		if (!mem || byte < mem || byte >= mem + regions[i].bytes)
+			continue;
+
+		meta_mark_range(&regions[i], byte - mem, len);
+
+		return;
+	}
+}
+
+/**
+ * @brief Opens a block to be written: one which was free when the flush
+ * started, taken round robin after the current one
+ *
+ * @return 0 on success, -ENOSPC if no block is free
+ */
+static int meta_open_block(void)
+{
+	struct meta_block_header *header = (void *)header_buffer;
+	uint32_t nb_blocks = meta_config.nb_blocks;
+	uint32_t ppb = meta_config.pages_per_block;
+	uint32_t start = meta_head == META_NONE ? 0 : meta_head / ppb;
+	uint32_t block;
+	uint32_t i;
+
+	/* Blocks erased ahead come first, the others are erased here */
+	for (i = 1; i <= 2 * nb_blocks; i++) {
+		block = (start + i) % nb_blocks;
+
+		if (!meta_reusable[block] ||
+		    (i <= nb_blocks && !meta_erased[block]))
+			continue;
+
+		meta_reusable[block] = 0;
+
+		if (!meta_erased[block] &&
+		    erase_block(block, 1, &meta_config,
+				metadata_format_callback)) {
+			printk(PRINT_PREF "Erasing meta-data block %u failed\n",
+			       block);
+			meta_bad[block] = 1;
+			continue;
+		}
+
+		meta_erased[block] = 0;
+
+		memset(header_buffer, 0xFF, meta_config.page_size);
+		header->magic = META_BLOCK_MAGIC;
+		header->seq = ++meta_seq;
+		header->checksum = meta_checksum(header_buffer + 8,
+						 sizeof(*header) - 8);
+
+		if (write_page(block * ppb, header_buffer, &meta_config)) {
+			printk(PRINT_PREF "Writing meta-data block header failed\n");
+			continue;
+		}
+
+		meta_head = block * ppb + 1;
+
+		return 0;
+	}
+
+	meta_head = META_NONE;
+
+	return -ENOSPC;
+}
+
+/**
+ * @brief Writes a page at the head of the meta-data partition
+ *
+ * @param buf Content of the page
+ * @param ppage Filled with the page written
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+static int meta_write(const uint8_t *buf, uint32_t *ppage)
+{
+	int tries;
+	int ret;
+
+	for (tries = 0; tries < META_WRITE_TRIES; tries++) {
+		if (meta_head == META_NONE ||
+		    meta_head % meta_config.pages_per_block == 0) {
+			ret = meta_open_block();
+
+			if (ret)
+				return ret;
+		}
+
+		*ppage = meta_head++;
+
+		if (!write_page(*ppage, buf, &meta_config))
+			return 0;
+
+		printk(PRINT_PREF "Write for %u page failed\n", *ppage);
+	}
+
+	return -EIO;
+}
+
+/**
+ * @brief Moves a page the last root refers to
+ *
+ * @param old Page the root referred to, META_NONE if none
+ * @param new Page written by the flush
+ */
+static void meta_live_move(uint32_t old, uint32_t new)
+{
+	if (old != META_NONE)
+		meta_live[old / meta_config.pages_per_block]--;
+
+	meta_live[new / meta_config.pages_per_block]++;
+}
+
+/**
+ * @brief Pages left in the block being written
+ *
+ * @return Number of pages
+ */
+static uint64_t meta_head_left(void)
+{
+	uint32_t ppb = meta_config.pages_per_block;
+
+	if (meta_head == META_NONE || meta_head % ppb == 0)
+		return 0;
+
+	return ppb - meta_head % ppb;
+}
+
+/**
+ * @brief Counts the pages a flush writes, and for each block how many of the
+ * pages it holds get written again elsewhere
+ *
+ * @return Number of pages to be written, root included
+ */
+static uint64_t meta_count_rewrites(void)
+{
+	uint32_t ppb = meta_config.pages_per_block;
+	uint64_t need = 1;
+	uint64_t lpage;
+	uint64_t dir;
+	bool moved;
+
+	/* The journal is folded in the root, its pages are released */
+	memcpy(meta_rewrite, journal_live,
+	       meta_config.nb_blocks * sizeof(uint32_t));
+
+	for (dir = 0; dir < meta_dir_pages; dir++) {
+		moved = dir_dirty[dir];
+
+		for (lpage = dir * dir_entries; lpage < meta_lpages &&
+		     lpage < (dir + 1) * dir_entries; lpage++) {
+			if (!lpage_dirty[lpage])
+				continue;
+
+			moved = true;
+			need++;
+
+			if (lpage_map[lpage] != META_NONE)
+				meta_rewrite[lpage_map[lpage] / ppb]++;
+		}
+
+		if (!moved)
+			continue;
+
+		need++;
+
+		if (dir_map[dir] != META_NONE)
+			meta_rewrite[dir_map[dir] / ppb]++;
+	}
+
+	if (root_ppage != META_NONE)
+		meta_rewrite[root_ppage / ppb]++;
+
+	return need;
+}
+
+/**
+ * @brief Cleans blocks ahead of the flush. The pages of the least used
+ * blocks are written again by the flush, so that enough blocks are free for
+ * a whole copy of the meta-data when the next flush starts.
+ *
+ * @param target Free blocks wanted after the flush
+ */
+static void meta_clean(uint64_t target)
+{
+	uint32_t nb_blocks = meta_config.nb_blocks;
+	uint32_t ppb = meta_config.pages_per_block;
+	uint32_t head_block = meta_head == META_NONE ? META_NONE :
+		(meta_head - 1) / ppb;
+	uint64_t head_left = meta_head_left();
+	int64_t free_after;
+	uint64_t need;
+	uint64_t lpage;
+	uint64_t dir;
+	uint32_t victim;
+	uint32_t block;
+	uint32_t left;
+	uint32_t i;
+
+	for (i = 0; i < nb_blocks; i++) {
+		need = meta_count_rewrites();
+
+		free_after = 0;
+		victim = META_NONE;
+		left = ppb;
+
+		for (block = 0; block < nb_blocks; block++) {
+			if (meta_reusable[block]) {
+				free_after++;
+				continue;
+			}
+
+			if (block == head_block || meta_live[block] == 0)
+				continue;
+
+			if (meta_rewrite[block] == meta_live[block]) {
+				free_after++;
+				continue;
+			}
+
+			if (meta_live[block] - meta_rewrite[block] < left) {
+				left = meta_live[block] - meta_rewrite[block];
+				victim = block;
+			}
+		}
+
+		if (need > head_left)
+			free_after -= bytes_to_pages(need - head_left, ppb - 1);
+
+		if (free_after >= (int64_t)target || victim == META_NONE)
+			return;
+
+		for (lpage = 0; lpage < meta_lpages; lpage++)
+			if (lpage_map[lpage] / ppb == victim)
+				lpage_dirty[lpage] = 1;
+
+		for (dir = 0; dir < meta_dir_pages; dir++)
+			if (dir_map[dir] / ppb == victim)
+				dir_dirty[dir] = 1;
+	}
+}
+
+/**
+ * @brief Blocks needed by a whole copy of the meta-data
+ *
+ * @return Number of blocks
+ */
+static uint64_t meta_copy_blocks(void)
+{
+	return bytes_to_pages(meta_lpages + meta_dir_pages + 1,
+			      meta_config.pages_per_block - 1);
+}
+
+/**
+ * @brief Blocks the journal may fill between two roots
+ *
+ * @return Number of blocks
+ */
+static uint64_t journal_blocks(void)
+{
+	return bytes_to_pages(journal_limit, meta_config.pages_per_block - 1);
+}
+
+/**
+ * @brief Checks if a journal flush can be written, leaving room for a whole
+ * copy of the meta-data
+ *
+ * @param count Journal pages to be written
+ *
+ * @return true if the journal can take the pages
+ */
+static bool journal_fits(uint64_t count)
+{
+	uint64_t head_left = meta_head_left();
+	int64_t free_after = 0;
+	uint32_t block;
+
+	if (journal_written + count > journal_limit)
+		return false;
+
+	for (block = 0; block < meta_config.nb_blocks; block++)
+		free_after += meta_reusable[block];
+
+	if (count > head_left)
+		free_after -= bytes_to_pages(count - head_left,
+					     meta_config.pages_per_block - 1);
+
+	return free_after >= (int64_t)meta_copy_blocks() + 1;
+}
+
+/**
+ * @brief Releases the mapper cache
+ */
+static void mapper_cache_destroy(void)
+{
+	struct mapper_slot *slot;
+	struct mapper_slot *next;
+
+	list_for_each_entry_safe(slot, next, &mapper_lru, lru) {
+		list_del(&slot->lru);
+		kfree(slot->data);
+		kfree(slot);
+	}
+
+	if (mapper_slots)
+		vfree(mapper_slots);
+
+	mapper_slots = NULL;
+	mapper_nr_slots = 0;
+	mapper_dirty = 0;
+}
+
+/**
+ * @brief Allocates an empty mapper cache, the slots come with the faults
+ *
+ * @return 0 on success, -ENOMEM on failure
+ */
+static int mapper_cache_init(void)
+{
+	mapper_slots = vzalloc(regions[MAPPER_REGION].pages *
+			       sizeof(struct mapper_slot *));
+
+	if (!mapper_slots) {
+		printk(PRINT_PREF "vmalloc failed for the mapper cache\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Reads a page of the mapper as the last root left it
+ *
+ * @param page Page of the mapper
+ * @param buf Filled with the page
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+static int mapper_read(uint64_t page, uint8_t *buf)
+{
+	struct meta_region *region = &regions[MAPPER_REGION];
+	uint32_t ppage = lpage_map[region->lpage + page];
+
+	/* Not flushed since the format */
+	if (ppage == META_NONE) {
+		memset(buf, region->fill, meta_config.page_size);
+		return 0;
+	}
+
+	return read_page(ppage, buf, &meta_config);
+}
+
+/**
+ * @brief Finds the least recently used slot which can be given another
+ * page, or allocates one while the cache is not full
+ *
+ * @return The slot, NULL on failure
+ */
+static struct mapper_slot *mapper_victim(void)
+{
+	struct mapper_slot *slot;
+
+	if (mapper_nr_slots >= mapper_cache_pages) {
+		list_for_each_entry_reverse(slot, &mapper_lru, lru) {
+			if (slot->dirty)
+				continue;
+
+			if (slot->page != MAPPER_NO_PAGE)
+				mapper_slots[slot->page] = NULL;
+
+			return slot;
+		}
+	}
+
+	slot = kmalloc(sizeof(struct mapper_slot), GFP_KERNEL);
+
+	if (!slot)
+		return NULL;
+
+	slot->data = kmalloc(meta_config.page_size, GFP_KERNEL);
+
+	if (!slot->data) {
+		kfree(slot);
+		return NULL;
+	}
+
+	list_add(&slot->lru, &mapper_lru);
+	mapper_nr_slots++;
+
+	return slot;
+}
+
+/**
+ * @brief Gets the slot of a page of the mapper, reading the page if it is
+ * not cached
+ *
+ * @param page Page of the mapper
+ *
+ * @return The slot, NULL on failure
+ */
+static struct mapper_slot *mapper_fetch(uint64_t page)
+{
+	struct mapper_slot *slot = mapper_slots[page];
+
+	if (slot) {
+		list_move(&slot->lru, &mapper_lru);
+		return slot;
+	}
+
+	slot = mapper_victim();
+
+	if (!slot) {
+		printk(PRINT_PREF "Allocation failed for the mapper cache\n");
+		return NULL;
+	}
+
+	slot->page = MAPPER_NO_PAGE;
+	slot->dirty = false;
+
+	if (mapper_read(page, slot->data)) {
+		printk(PRINT_PREF "Reading mapper page %llu failed\n", page);
+		list_move_tail(&slot->lru, &mapper_lru);
+		return NULL;
+	}
+
+	list_move(&slot->lru, &mapper_lru);
+	slot->page = page;
+	mapper_slots[page] = slot;
+
+	return slot;
+}
+
+/**
+ * @brief Marks a cached page of the mapper as modified, it is kept until
+ * the next root
+ *
+ * @param slot Slot of the page
+ */
+static void mapper_set_dirty(struct mapper_slot *slot)
+{
+	if (slot->dirty)
+		return;
+
+	slot->dirty = true;
+	mapper_dirty++;
+}
+
+/**
+ * @brief Frees the least recently used slots past the size of the cache,
+ * once a root wrote the modified pages back
+ */
+static void mapper_shrink(void)
+{
+	struct mapper_slot *slot;
+	struct mapper_slot *prev;
+
+	list_for_each_entry_safe_reverse(slot, prev, &mapper_lru, lru) {
+		if (mapper_nr_slots <= mapper_cache_pages)
+			break;
+
+		if (slot->dirty)
+			continue;
+
+		if (slot->page != MAPPER_NO_PAGE)
+			mapper_slots[slot->page] = NULL;
+
+		list_del(&slot->lru);
+		kfree(slot->data);
+		kfree(slot);
+		mapper_nr_slots--;
+	}
+}
+
+/**
+ * @brief Checks if so many pages of the mapper are modified that a root
+ * should write them back
+ *
+ * @return true if the cache is crowded
+ */
+static bool mapper_crowded(void)
+{
+	return mapper_slots && mapper_dirty * 2 >= mapper_cache_pages;
+}
+
+/**
+ * @brief Reads a stored mapper entry
+ *
+ * @param mem Array of stored entries
+ * @param index Index of the entry
+ *
+ * @return Mapper entry in its 64 bits form
+ */
+static uint64_t mapper_load(const void *mem, uint64_t index)
+{
+	uint32_t stored;
+
+	if (mapper_entry_bytes == sizeof(uint64_t))
+		return ((const uint64_t *)mem)[index];
+
+	stored = ((const uint32_t *)mem)[index];
+
+	if (stored == MAPPER32_UNALLOCATED)
+		return PAGE_UNALLOCATED;
+
+	if (stored == MAPPER32_RECLAIMED)
+		return PAGE_GARBAGE_RECLAIMED;
+
+	return (stored & ((1U << mapper_slot_shift) - 1)) |
+		((uint64_t)(stored >> mapper_slot_shift) << MAPPER_SLOT_SHIFT);
+}
+
+/**
+ * @brief Stores a mapper entry
+ *
+ * @param mem Array of stored entries
+ * @param index Index of the entry
+ * @param entry Mapper entry in its 64 bits form
+ */
+static void mapper_store(void *mem, uint64_t index, uint64_t entry)
+{
+	uint32_t stored;
+
+	if (mapper_entry_bytes == sizeof(uint64_t)) {
+		((uint64_t *)mem)[index] = entry;
+		return;
+	}
+
+	if (entry == PAGE_UNALLOCATED)
+		stored = MAPPER32_UNALLOCATED;
+	else if (entry == PAGE_GARBAGE_RECLAIMED)
+		stored = MAPPER32_RECLAIMED;
+	else
+		stored = MAPPER_PPAGE(entry) |
+			(MAPPER_SLOT(entry) << mapper_slot_shift);
+
+	((uint32_t *)mem)[index] = stored;
+}
+
+/**
+ * @brief Gets the mapper entry of a vpage
+ *
+ * @param vpage Vpage to be looked up
+ * @param entry Filled with the mapper entry
+ *
+ * @return 0 on success, -EIO if its mapper page cannot be read
+ */
+int project6_get_vpage_entry(uint64_t vpage, uint64_t *entry)
+{
+	uint64_t per_page = meta_config.page_size / mapper_entry_bytes;
+	struct mapper_slot *slot;
+
+	if (mapper) {
+		*entry = mapper_load(mapper, vpage);
+		return 0;
+	}
+
+	mutex_lock(&mapper_lock);
+
+	slot = mapper_fetch(vpage / per_page);
+
+	if (slot)
+		*entry = mapper_load(slot->data, vpage % per_page);
+
+	mutex_unlock(&mapper_lock);
+
+	return slot ? 0 : -EIO;
+}
+
+/**
+ * @brief Stores the mapper entry of a vpage and marks it modified
+ *
+ * @param vpage Vpage to be updated
+ * @param entry New mapper entry
+ *
+ * @return 0 on success, -EIO if its mapper page cannot be read, the entry
+ * is left unchanged then
+ */
+int project6_put_vpage_entry(uint64_t vpage, uint64_t entry)
+{
+	uint64_t per_page = meta_config.page_size / mapper_entry_bytes;
+	struct mapper_slot *slot;
+
+	if (mapper) {
+		mapper_store(mapper, vpage, entry);
+		project6_mark_meta_data_dirty((uint8_t *)mapper +
+					      vpage * mapper_entry_bytes,
+					      mapper_entry_bytes);
+		return 0;
+	}
+
+	mutex_lock(&mapper_lock);
+
+	slot = mapper_fetch(vpage / per_page);
+
+	if (slot) {
+		mapper_store(slot->data, vpage % per_page, entry);
+		mapper_set_dirty(slot);
+		meta_mark_range(&regions[MAPPER_REGION],
+				vpage * mapper_entry_bytes,
+				mapper_entry_bytes);
+	}
+
+	mutex_unlock(&mapper_lock);
+
+	return slot ? 0 : -EIO;
+}
+
+/**
+ * @brief Releases the in memory meta-data
+ */
+void project6_destroy_meta_data(void)
+{
+	size_t i;
+
+	project6_index_destroy();
+	project6_packed_destroy();
+	project6_free_pool_destroy();
+	project6_rmap_destroy();
+	project6_gc_destroy();
+	mapper_cache_destroy();
+
+	for (i = 0; i < NUM_META_REGIONS; i++) {
+		if (*regions[i].mem)
+			vfree(*regions[i].mem);
+		*regions[i].mem = NULL;
+	}
+
+	if (lpage_map)
+		vfree(lpage_map);
+	if (lpage_pending)
+		vfree(lpage_pending);
+	if (lpage_dirty)
+		vfree(lpage_dirty);
+	if (dir_map)
+		vfree(dir_map);
+	if (dir_pending)
+		vfree(dir_pending);
+	if (dir_dirty)
+		vfree(dir_dirty);
+	if (meta_live)
+		vfree(meta_live);
+	if (meta_rewrite)
+		vfree(meta_rewrite);
+	if (meta_reusable)
+		vfree(meta_reusable);
+	if (meta_erased)
+		vfree(meta_erased);
+	if (meta_bad)
+		vfree(meta_bad);
+	if (meta_buffer)
+		kfree(meta_buffer);
+	if (header_buffer)
+		kfree(header_buffer);
+	if (block_seq)
+		vfree(block_seq);
+	if (journal_ranges)
+		vfree(journal_ranges);
+	if (journal_live)
+		vfree(journal_live);
+	if (journal_flush_pages)
+		vfree(journal_flush_pages);
+
+	lpage_map = NULL;
+	lpage_pending = NULL;
+	lpage_dirty = NULL;
+	dir_map = NULL;
+	dir_pending = NULL;
+	dir_dirty = NULL;
+	meta_live = NULL;
+	meta_rewrite = NULL;
+	meta_reusable = NULL;
+	meta_erased = NULL;
+	meta_bad = NULL;
+	meta_buffer = NULL;
+	header_buffer = NULL;
+	block_seq = NULL;
+	journal_ranges = NULL;
+	journal_live = NULL;
+	journal_flush_pages = NULL;
+	root_ppage = META_NONE;
+	meta_head = META_NONE;
+	meta_changes = 0;
+	journal_nr_ranges = 0;
+	journal_written = 0;
+	journal_full = false;
+}
+
+/**
+ * @brief Allocates the page maps of the meta-data partition
+ *
+ * @return 0 on success, -ENOMEM on failure
+ */
+static int meta_maps_alloc(void)
+{
+	uint32_t nb_blocks = meta_config.nb_blocks;
+
+	lpage_map = vmalloc(meta_lpages * sizeof(uint32_t));
+	lpage_pending = vmalloc(meta_lpages * sizeof(uint32_t));
+	lpage_dirty = vzalloc(meta_lpages);
+	dir_map = vmalloc(meta_dir_pages * sizeof(uint32_t));
+	dir_pending = vmalloc(meta_dir_pages * sizeof(uint32_t));
+	dir_dirty = vzalloc(meta_dir_pages);
+	meta_live = vzalloc(nb_blocks * sizeof(uint32_t));
+	meta_rewrite = vzalloc(nb_blocks * sizeof(uint32_t));
+	meta_reusable = vzalloc(nb_blocks);
+	meta_erased = vzalloc(nb_blocks);
+	meta_bad = vzalloc(nb_blocks);
+	meta_buffer = kmalloc(meta_config.page_size, GFP_KERNEL);
+	header_buffer = kmalloc(meta_config.page_size, GFP_KERNEL);
+	block_seq = vzalloc(nb_blocks * sizeof(uint64_t));
+	journal_ranges = vmalloc((journal_max_ranges + 1) *
+				 sizeof(struct meta_journal_record));
+	journal_live = vzalloc(nb_blocks * sizeof(uint32_t));
+	journal_flush_pages = vmalloc((journal_limit + 1) * sizeof(uint32_t));
+
+	if (!lpage_map || !lpage_pending || !lpage_dirty || !dir_map ||
+	    !dir_pending || !dir_dirty || !meta_live || !meta_rewrite ||
+	    !meta_reusable || !meta_erased || !meta_bad || !meta_buffer ||
+	    !header_buffer || !block_seq || !journal_ranges ||
+	    !journal_live || !journal_flush_pages) {
+		printk(PRINT_PREF "Allocation failed for the meta-data maps\n");
+		return -ENOMEM;
+	}
+
+	memset(lpage_map, 0xFF, meta_lpages * sizeof(uint32_t));
+	memset(lpage_pending, 0xFF, meta_lpages * sizeof(uint32_t));
+	memset(dir_map, 0xFF, meta_dir_pages * sizeof(uint32_t));
+	memset(dir_pending, 0xFF, meta_dir_pages * sizeof(uint32_t));
+
+	return 0;
+}
+
+/**
+ * @brief Finds the last committed root: the newest one of the newest block
+ * holding a root. It is left in meta_buffer.
+ *
+ * @return 0 on success, -1 if the partition holds no root
+ */
+static int meta_find_root(void)
+{
+	struct meta_block_header *header = (void *)meta_buffer;
+	struct meta_root *root = (void *)meta_buffer;
+	uint32_t nb_blocks = meta_config.nb_blocks;
+	uint32_t ppb = meta_config.pages_per_block;
+	uint64_t limit = U64_MAX;
+	uint64_t best_seq;
+	uint64_t newest;
+	uint32_t best;
+	uint32_t found = META_NONE;
+	uint32_t block;
+	uint32_t page;
+
+	for (block = 0; block < nb_blocks; block++) {
+		block_seq[block] = 0;
+
+		if (read_page(block * ppb, meta_buffer, &meta_config))
+			continue;
+
+		if (meta_check(META_BLOCK_MAGIC, sizeof(*header)))
+			block_seq[block] = header->seq;
+
+		/* Sequence numbers keep growing after the mount */
+		meta_seq = max(meta_seq, block_seq[block]);
+	}
+
+	while (found == META_NONE) {
+		best = META_NONE;
+		best_seq = 0;
+
+		for (block = 0; block < nb_blocks; block++) {
+			if (block_seq[block] > best_seq &&
+			    block_seq[block] < limit) {
+				best_seq = block_seq[block];
+				best = block;
+			}
+		}
+
+		if (best == META_NONE)
+			break;
+
+		limit = best_seq;
+		newest = 0;
+
+		for (page = best * ppb + 1; page < (best + 1) * ppb; page++) {
+			if (read_page(page, meta_buffer, &meta_config) ||
+			    root->magic != META_ROOT_MAGIC ||
+			    !meta_check(META_ROOT_MAGIC,
+					root_bytes(root->dir_pages)) ||
+			    root->seq <= newest)
+				continue;
+
+			newest = root->seq;
+			found = page;
+		}
+	}
+
+	if (found == META_NONE ||
+	    read_page(found, meta_buffer, &meta_config))
+		return -1;
+
+	root_ppage = found;
+	root_seq = root->seq;
+
+	return 0;
+}
+
+/**
+ * @brief Finds the memory of a byte of the logical pages, a page of the
+ * mapper is read if it is not cached
+ *
+ * @param offset Offset of the byte from the first logical page
+ * @param modify The byte is about to be modified
+ *
+ * @return Address of the byte, NULL on failure
+ */
+static uint8_t *meta_image(uint64_t offset, bool modify)
+{
+	uint64_t lpage = offset / meta_config.page_size;
+	struct mapper_slot *slot;
+	uint64_t start;
+	size_t i;
+
+	for (i = 0; i < NUM_META_REGIONS - 1; i++)
+		if (lpage < regions[i].lpage + regions[i].pages)
+			break;
+
+	start = regions[i].lpage * meta_config.page_size;
+
+	if (*regions[i].mem)
+		return (uint8_t *)*regions[i].mem + offset - start;
+
+	slot = mapper_fetch(lpage - regions[i].lpage);
+
+	if (!slot)
+		return NULL;
+
+	if (modify)
+		mapper_set_dirty(slot);
+
+	return slot->data + (offset - start) % meta_config.page_size;
+}
+
+/**
+ * @brief Fills a journal page with the next modified ranges. A record does
+ * not span two logical pages, longer ranges are split.
+ *
+ * @param page Page to be filled, NULL to only count the bytes
+ * @param range Next range to be journaled, advanced
+ * @param done Bytes of that range already journaled, advanced
+ *
+ * @return Bytes of records in the page
+ */
+static uint32_t journal_fill(struct meta_journal_page *page, uint64_t *range,
+			     uint32_t *done)
+{
+	uint32_t page_size = meta_config.page_size;
+	uint32_t space = page_size - sizeof(struct meta_journal_page);
+	struct meta_journal_record record;
+	uint32_t bytes = 0;
+
+	while (*range < journal_nr_ranges &&
+	       space - bytes > sizeof(record)) {
+		record.offset = journal_ranges[*range].offset + *done;
+		record.len = min_t(uint32_t,
+				   journal_ranges[*range].len - *done,
+				   space - bytes - sizeof(record));
+		record.len = min_t(uint32_t, record.len,
+				   page_size - record.offset % page_size);
+
+		/* Modified pages of the mapper are kept, they are cached */
+		if (page) {
+			memcpy(page->records + bytes, &record, sizeof(record));
+			memcpy(page->records + bytes + sizeof(record),
+			       meta_image(record.offset, false), record.len);
+		}
+
+		bytes += sizeof(record) + record.len;
+		*done += record.len;
+
+		if (*done == journal_ranges[*range].len) {
+			(*range)++;
+			*done = 0;
+		}
+	}
+
+	return bytes;
+}
+
+/**
+ * @brief Counts the journal pages holding the modified ranges
+ *
+ * @return Number of pages
+ */
+static uint64_t journal_count_pages(void)
+{
+	uint64_t pages = 0;
+	uint64_t range = 0;
+	uint32_t done = 0;
+
+	while (range < journal_nr_ranges) {
+		journal_fill(NULL, &range, &done);
+		pages++;
+	}
+
+	return pages;
+}
+
+/**
+ * @brief Appends the modified ranges to the journal of the last root
+ *
+ * @param count Journal pages needed
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+static int journal_write(uint64_t count)
+{
+	struct meta_journal_page *page = (void *)meta_buffer;
+	uint32_t ppb = meta_config.pages_per_block;
+	uint64_t flush_seq = ++meta_seq;
+	uint64_t range = 0;
+	uint32_t done = 0;
+	uint32_t index;
+	int ret;
+
+	for (index = 0; index < count; index++) {
+		memset(meta_buffer, 0xFF, meta_config.page_size);
+
+		page->magic = META_JOURNAL_MAGIC;
+		page->root_seq = root_seq;
+		page->flush_seq = flush_seq;
+		page->total_written_page = total_written_page;
+		page->log_vpage = log_vpage;
+		page->index = index;
+		page->count = count;
+		page->pad = 0;
+
+		mutex_lock(&mapper_lock);
+		page->bytes = journal_fill(page, &range, &done);
+		mutex_unlock(&mapper_lock);
+
+		page->checksum = meta_checksum(meta_buffer + 8,
+					       sizeof(*page) + page->bytes - 8);
+
+		ret = meta_write(meta_buffer, &journal_flush_pages[index]);
+
+		if (ret)
+			return ret;
+	}
+
+	/* The flush is complete, its pages are kept until the next root */
+	for (index = 0; index < count; index++) {
+		meta_live[journal_flush_pages[index] / ppb]++;
+		journal_live[journal_flush_pages[index] / ppb]++;
+	}
+
+	journal_written += count;
+	journal_nr_ranges = 0;
+
+	return 0;
+}
+
+/**
+ * @brief Journal page found at mount
+ */
+struct journal_scan {
+	uint64_t flush_seq;
+	uint32_t ppage;
+	uint32_t index;
+	uint32_t count;
+};
+
+/**
+ * @brief Finds a page of a journaled flush
+ *
+ * @param scan Journal pages found
+ * @param nr Number of pages found
+ * @param flush_seq Flush of the page
+ * @param index Index of the page in the flush
+ *
+ * @return The page, NULL if it was not found
+ */
+static struct journal_scan *journal_find(struct journal_scan *scan,
+					 uint64_t nr, uint64_t flush_seq,
+					 uint32_t index)
+{
+	uint64_t i;
+
+	for (i = 0; i < nr; i++)
+		if (scan[i].flush_seq == flush_seq && scan[i].index == index)
+			return &scan[i];
+
+	return NULL;
+}
+
+/**
+ * @brief Applies the records of a journal page read in meta_buffer
+ *
+ * @return 0 on success, -1 if a record is out of the logical pages
+ */
+static int journal_apply(void)
+{
+	struct meta_journal_page *page = (void *)meta_buffer;
+	uint32_t page_size = meta_config.page_size;
+	struct meta_journal_record record;
+	uint8_t *image;
+	uint64_t lpage;
+	uint32_t pos = 0;
+
+	while (pos + sizeof(record) <= page->bytes) {
+		memcpy(&record, page->records + pos, sizeof(record));
+		pos += sizeof(record);
+
+		lpage = record.offset / page_size;
+
+		if (record.len > page->bytes - pos || lpage >= meta_lpages ||
+		    record.offset % page_size + record.len > page_size)
+			return -1;
+
+		image = meta_image(record.offset, true);
+
+		if (!image)
+			return -1;
+
+		memcpy(image, page->records + pos, record.len);
+		pos += record.len;
+
+		/* Not in the pages of the root anymore */
+		lpage_dirty[lpage] = 1;
+	}
+
+	total_written_page = page->total_written_page;
+	log_vpage = page->log_vpage;
+
+	return 0;
+}
+
+/**
+ * @brief Replays the flushes journaled after the last root, in order. The
+ * pages of a flush which did not complete are ignored.
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+static int journal_replay(void)
+{
+	struct meta_journal_page *page = (void *)meta_buffer;
+	uint32_t nb_blocks = meta_config.nb_blocks;
+	uint32_t ppb = meta_config.pages_per_block;
+	uint32_t root_block = root_ppage / ppb;
+	struct journal_scan *scan;
+	struct journal_scan *found;
+	uint64_t applied = 0;
+	uint64_t next;
+	uint64_t nr = 0;
+	uint64_t i;
+	uint32_t block;
+	uint32_t ppage;
+	uint32_t index;
+	int ret = 0;
+
+	scan = vmalloc((uint64_t)nb_blocks * ppb * sizeof(*scan));
+
+	if (!scan)
+		return -ENOMEM;
+
+	/* The journal follows the root, in the blocks opened after its own */
+	for (block = 0; block < nb_blocks; block++) {
+		if (block != root_block &&
+		    block_seq[block] <= block_seq[root_block])
+			continue;
+
+		ppage = block == root_block ? root_ppage + 1 : block * ppb + 1;
+
+		for (; ppage < (block + 1) * ppb; ppage++) {
+			if (read_page(ppage, meta_buffer, &meta_config) ||
+			    page->magic != META_JOURNAL_MAGIC ||
+			    page->bytes > meta_config.page_size ||
+			    !meta_check(META_JOURNAL_MAGIC,
+					sizeof(*page) + page->bytes) ||
+			    page->index >= page->count)
+				continue;
+
+			meta_seq = max(meta_seq, page->flush_seq);
+
+			if (page->root_seq != root_seq)
+				continue;
+
+			scan[nr].flush_seq = page->flush_seq;
+			scan[nr].ppage = ppage;
+			scan[nr].index = page->index;
+			scan[nr].count = page->count;
+			nr++;
+		}
+	}
+
+	for (;;) {
+		next = U64_MAX;
+
+		for (i = 0; i < nr; i++)
+			if (scan[i].flush_seq > applied &&
+			    scan[i].flush_seq < next)
+				next = scan[i].flush_seq;
+
+		if (next == U64_MAX)
+			break;
 
+		applied = next;
+		found = journal_find(scan, nr, next, 0);
 
-static uint64_t meta_data_block = 0;
+		for (index = 0; found && index < found->count; index++)
+			if (!journal_find(scan, nr, next, index))
+				break;
 
-/* Jiffies for controlling the meta-data flush */
-static unsigned long old_meta_jiffies = 0;
+		if (!found || index < found->count)
+			continue;
 
-#define PRINT_PREF KERN_INFO "META-DATA "
+		for (index = 0; index < found->count; index++) {
+			ppage = journal_find(scan, nr, next, index)->ppage;
+
+			if (read_page(ppage, meta_buffer, &meta_config) ||
+			    journal_apply()) {
+				printk(PRINT_PREF "Replaying journal page %u failed\n",
+				       ppage);
+				ret = -1;
+				goto out;
+			}
+
+			meta_live[ppage / ppb]++;
+			journal_live[ppage / ppb]++;
+			journal_written++;
+		}
+	}
+
+out:
+	vfree(scan);
+
+	return ret;
+}
 
 /**
- * @brief Creates a new metadata from scratch
+ * @brief Reads the last committed meta-data from the partition
  *
- * @param meta_config Configuration of the meta-data
- * @param block_num block used to create the meta-data
- *
- * @return returns 0 on success, otherwise appropriate error code
+ * @return 0 on success, otherwise appropriate error code
  */
-int project6_create_meta_data(project6_cfg *meta_config, uint32_t block_num)
+static int meta_load(void)
 {
-	uint32_t *signature = (uint32_t *)page_buffer;
+	struct meta_root *root = (void *)meta_buffer;
+	uint32_t ppb = meta_config.pages_per_block;
+	struct meta_region *region;
+	uint8_t *mem;
+	uint64_t lpage;
+	uint64_t dir;
+	uint64_t count;
 	size_t i;
-	int ret;
+	size_t j;
+
+	if (meta_find_root()) {
+		printk(PRINT_PREF "You must format the flash before usage\n");
+		return -1;
+	}
+
+	if (root->lpages != meta_lpages || root->dir_pages != meta_dir_pages) {
+		printk(PRINT_PREF "Meta-data does not match the partitions, format the flash\n");
+		return -1;
+	}
 
-	for (i = 0; i < meta_config->page_size; i++)
-		page_buffer[i] = 0xFF;
+	meta_seq = max(meta_seq, root->seq);
+	total_written_page = root->total_written_page;
+	log_vpage = root->log_vpage;
+	memcpy(dir_map, root->dir, meta_dir_pages * sizeof(uint32_t));
 
-	*signature = 0xdeadbeef;
+	meta_live[root_ppage / ppb]++;
 
-	*(signature+4) = total_written_page;
+	for (dir = 0; dir < meta_dir_pages; dir++) {
+		if (read_page(dir_map[dir], meta_buffer, &meta_config)) {
+			printk(PRINT_PREF "Read for %u page failed\n",
+			       dir_map[dir]);
+			return -1;
+		}
 
-	ret = write_page(block_num * meta_config->pages_per_block,
-			 page_buffer, meta_config);
+		count = min(dir_entries, meta_lpages - dir * dir_entries);
+		memcpy(lpage_map + dir * dir_entries, meta_buffer,
+		       count * sizeof(uint32_t));
 
-	if (ret) {
-		printk(PRINT_PREF "Writing page for signature failed\n");
-		return ret;
+		meta_live[dir_map[dir] / ppb]++;
 	}
 
-	return 0;
+	for (i = 0; i < NUM_META_REGIONS; i++) {
+		region = &regions[i];
+		mem = *region->mem;
+
+		for (j = 0; j < region->pages; j++) {
+			lpage = region->lpage + j;
+
+			/* Cached pages of the mapper are read when needed */
+			if (!mem) {
+				meta_live[lpage_map[lpage] / ppb]++;
+				continue;
+			}
+
+			if (read_page(lpage_map[lpage],
+				      mem + j * meta_config.page_size,
+				      &meta_config) != 0) {
+				printk(PRINT_PREF "Read for %u page failed\n",
+				       lpage_map[lpage]);
+				return -1;
+			}
+
+			meta_live[lpage_map[lpage] / ppb]++;
+		}
+	}
+
+	return journal_replay();
 }
 
 /**
@@ -79,7 +1717,8 @@ int project6_create_meta_data(project6_cfg *meta_config, uint32_t block_num)
  *
  * @param meta_config Config Pointer of meta-data partition
  * @param data_config Config Pointer of data partition
- * @param read_disk Read from disk or perform default meta-data construction
+ * @param read_disk Read from disk, or start an empty meta-data on a freshly
+ * erased meta-data partition
  *
  * @return 0 for success, otherwise appropriate error code
  */
@@ -87,203 +1726,667 @@ int project6_construct_meta_data(project6_cfg *meta_config,
 			project6_cfg *data_config,
 			bool read_disk)
 {
-	uint32_t *signature = (uint32_t *)page_buffer;
-	uint64_t bitmap_size = data_config->nb_blocks *
+	uint64_t num_pages = data_config->nb_blocks *
 		data_config->pages_per_block;
-	uint64_t bitmap_bytes;
-
-	uint64_t mapper_bytes = data_config->nb_blocks *
-		data_config->pages_per_block * sizeof(uint64_t);
+	struct meta_region *region;
+	uint8_t *mem;
 	size_t i = 0;
-	size_t j = 0;
 	int ret;
 
-	uint32_t block_count = 0;
-	uint64_t start_page = 0;
+	project6_destroy_meta_data();
 
-	uint8_t *byte_mapper;
+	/* 32 bits mapper entries need the ppage and the slot to fit */
+	mapper_slot_shift = 0;
 
-	if (read_disk == true) {
-		while (block_count < meta_config->nb_blocks) {
+	while ((1ULL << mapper_slot_shift) < num_pages)
+		mapper_slot_shift++;
 
-			start_page = block_count * meta_config->pages_per_block;
+	if (mapper_slot_shift + MAPPER_SLOT_BITS <= 32)
+		mapper_entry_bytes = sizeof(uint32_t);
+	else
+		mapper_entry_bytes = sizeof(uint64_t);
 
-			ret = read_page(start_page, page_buffer, meta_config);
-			if (ret) {
-				printk(PRINT_PREF "Read for constructing meta-data failed\n");
-				return ret;
-			}
+	/* 2 bits of state per ppage */
+	regions[0].bytes = num_pages / 4 + (num_pages % 4 ? 1 : 0);
+	regions[1].bytes = num_pages * mapper_entry_bytes;
+	regions[2].bytes = num_pages * sizeof(uint32_t);
+	regions[3].bytes = project6_bloom_bytes(num_pages);
+	regions[4].bytes = data_config->nb_blocks * sizeof(project6_block_info);
 
-			if (*signature == 0xdeadbeef) {
-				total_written_page = *(signature + 4);
-				break;
-			}
-			block_count++;
-		}
-		if (*signature != 0xdeadbeef) {
-			printk(PRINT_PREF "You must format the flash before usage\n");
+	meta_lpages = 0;
+
+	for (i = 0; i < NUM_META_REGIONS; i++) {
+		regions[i].lpage = meta_lpages;
+		regions[i].pages = bytes_to_pages(regions[i].bytes,
+						  meta_config->page_size);
+		meta_lpages += regions[i].pages;
+	}
+
+	dir_entries = meta_config->page_size / sizeof(uint32_t);
+	meta_dir_pages = bytes_to_pages(meta_lpages, dir_entries);
+
+	/* A whole new copy is written before the old one is erased */
+	if (root_bytes(meta_dir_pages) > meta_config->page_size ||
+	    2 * meta_copy_blocks() + 2 > meta_config->nb_blocks) {
+
+		printk(PRINT_PREF " Not enough pages for meta-data in meta partition\n");
+		return -1;
+	}
+
+	/* The journal takes the blocks left, records have 32 bits offsets */
+	journal_limit = (meta_config->nb_blocks - 2 * meta_copy_blocks() - 2) *
+		(meta_config->pages_per_block - 1);
+	journal_limit = min_t(uint64_t, journal_limit, meta_journal_pages);
+
+	if (meta_lpages * meta_config->page_size > U32_MAX)
+		journal_limit = 0;
+
+	journal_max_ranges = journal_limit * meta_config->page_size /
+		(2 * sizeof(struct meta_journal_record));
+
+	ret = meta_maps_alloc();
+
+	if (ret)
+		return ret;
+
+	if (mapper_cache_pages) {
+		ret = mapper_cache_init();
+
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < NUM_META_REGIONS; i++) {
+		region = &regions[i];
+
+		if (i == MAPPER_REGION && mapper_cache_pages)
+			continue;
+
+		mem = (uint8_t *) vmalloc(region->pages *
+					  meta_config->page_size);
+
+		if (mem == NULL) {
+			printk(PRINT_PREF "vmalloc failed for region %lu allocation\n",
+			       i);
 			return -1;
 		}
+
+		*region->mem = mem;
+
+		if (!read_disk)
+			memset(mem, region->fill,
+			       region->pages * meta_config->page_size);
+	}
+
+	if (read_disk) {
+		meta_seq = 0;
+		ret = meta_load();
+
+		if (ret) {
+			project6_destroy_meta_data();
+			return ret;
+		}
+	} else {
+		/* Everything goes to flash at the first flush */
+		meta_seq = 0;
+		memset(lpage_dirty, 1, meta_lpages);
+		meta_changes = meta_lpages;
+		memset(meta_erased, 1, meta_config->nb_blocks);
 	}
 
-	bitmap_start = start_page + 1;
-	meta_data_block = block_count;
+	project6_block_info_init(read_disk);
 
-	if (bitmap_size % 4 == 0)
-		bitmap_bytes = bitmap_size / 4;
-	else
-		bitmap_bytes = bitmap_size / 4 + 1;
+	ret = project6_gc_init();
 
-	if (bitmap_bytes % meta_config->page_size == 0)
-		bitmap_pages = bitmap_bytes / meta_config->page_size;
-	else
-		bitmap_pages = bitmap_bytes / meta_config->page_size + 1;
+	if (ret)
+		return ret;
+
+	ret = project6_index_init(num_pages);
 
+	if (ret)
+		return ret;
 
-	if (bitmap_start + bitmap_pages > meta_config->nb_blocks *
-	    meta_config->pages_per_block) {
+	ret = project6_packed_init(num_pages);
 
-		printk(PRINT_PREF " Not enough pages for bitmap in meta partition\n");
-		return -1;
-	}
+	if (ret)
+		return ret;
 
-	bitmap = (uint8_t *) kmalloc(bitmap_pages * meta_config->page_size,
-				     GFP_KERNEL);
+	/* Fills the live slots of the packed pages too */
+	ret = project6_rmap_init(num_pages);
 
-	if (bitmap == NULL) {
-		printk(PRINT_PREF "kmalloc failed for bitmap allocation\n");
-		return -1;
+	if (ret)
+		return ret;
+
+	ret = project6_free_pool_init();
+
+	if (ret)
+		return ret;
+
+	return 0;
+}
+
+/**
+ * @brief Writes the modified logical pages and the directory pages mapping
+ * them, at pages not used by the last root
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+static int meta_write_pages(void)
+{
+	struct meta_region *region = &regions[0];
+	uint32_t *entries = (uint32_t *)meta_buffer;
+	struct mapper_slot *slot;
+	uint8_t *image;
+	uint64_t lpage;
+	uint64_t dir;
+	uint64_t count;
+	bool moved;
+	int ret;
+
+	for (lpage = 0; lpage < meta_lpages; lpage++) {
+		if (!lpage_dirty[lpage])
+			continue;
+
+		while (lpage >= region->lpage + region->pages)
+			region++;
+
+		image = (uint8_t *)*region->mem +
+			(lpage - region->lpage) * meta_config.page_size;
+
+		/* The lookups may evict a clean page of the mapper while it is
+		 * written, it is copied. One moved by the cleaning may not be
+		 * cached */
+		if (!*region->mem) {
+			ret = 0;
+			image = meta_buffer;
+
+			mutex_lock(&mapper_lock);
+			slot = mapper_slots[lpage - region->lpage];
+
+			if (slot)
+				memcpy(meta_buffer, slot->data,
+				       meta_config.page_size);
+			else
+				ret = mapper_read(lpage - region->lpage,
+						  meta_buffer);
+			mutex_unlock(&mapper_lock);
+
+			if (ret)
+				return ret;
+		}
+
+		ret = meta_write(image, &lpage_pending[lpage]);
+
+		if (ret)
+			return ret;
 	}
 
-	for (i = bitmap_start; i < bitmap_start + bitmap_pages ; i++) {
-		if (read_disk) {
-			if (read_page(i, bitmap + (j) * meta_config->page_size,
-				      meta_config) != 0) {
-				printk(PRINT_PREF
-				       "Read for %lu page failed\n", i);
-				return -1;
-			}
-			j++;
-		} else {
-			memset(bitmap, 0xFF,
-			       bitmap_pages * meta_config->page_size);
+	for (dir = 0; dir < meta_dir_pages; dir++) {
+		count = min(dir_entries, meta_lpages - dir * dir_entries);
+		moved = dir_dirty[dir];
+
+		memset(meta_buffer, 0xFF, meta_config.page_size);
+
+		for (lpage = 0; lpage < count; lpage++) {
+			entries[lpage] = lpage_map[dir * dir_entries + lpage];
+
+			if (lpage_pending[dir * dir_entries + lpage] ==
+			    META_NONE)
+				continue;
+
+			entries[lpage] = lpage_pending[dir * dir_entries + lpage];
+			moved = true;
 		}
+
+		if (!moved)
+			continue;
+
+		ret = meta_write(meta_buffer, &dir_pending[dir]);
+
+		if (ret)
+			return ret;
 	}
 
-	mapper_start = bitmap_pages + bitmap_start + 1;
+	return 0;
+}
+
+/**
+ * @brief Writes the root of the flush, then makes the pages written by the
+ * flush the current ones
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+static int meta_commit(void)
+{
+	struct meta_root *root = (void *)meta_buffer;
+	size_t len = root_bytes(meta_dir_pages);
+	struct mapper_slot *slot;
+	uint32_t block;
+	uint32_t ppage;
+	uint64_t lpage;
+	uint64_t dir;
+	int ret;
 
-	if (mapper_bytes % meta_config->page_size == 0)
-		mapper_pages = mapper_bytes / meta_config->page_size;
-	else
-		mapper_pages = mapper_bytes / meta_config->page_size + 1;
+	memset(meta_buffer, 0xFF, meta_config.page_size);
 
-	if (mapper_start + mapper_pages > meta_config->nb_blocks *
-	    meta_config->pages_per_block) {
+	root->magic = META_ROOT_MAGIC;
+	root->seq = ++meta_seq;
+	root->total_written_page = total_written_page;
+	root->log_vpage = log_vpage;
+	root->lpages = meta_lpages;
+	root->dir_pages = meta_dir_pages;
 
-		printk(PRINT_PREF " Not enough pages for mapper in meta partition\n");
-		return -1;
+	for (dir = 0; dir < meta_dir_pages; dir++)
+		root->dir[dir] = dir_pending[dir] != META_NONE ?
+			dir_pending[dir] : dir_map[dir];
+
+	root->checksum = meta_checksum(meta_buffer + 8, len - 8);
+
+	ret = meta_write(meta_buffer, &ppage);
+
+	if (ret)
+		return ret;
+
+	meta_live_move(root_ppage, ppage);
+	root_ppage = ppage;
+	root_seq = root->seq;
+
+	for (block = 0; block < meta_config.nb_blocks; block++) {
+		meta_live[block] -= journal_live[block];
+		journal_live[block] = 0;
 	}
 
-	mapper = (uint64_t *) kmalloc(mapper_pages * meta_config->page_size,
-				      GFP_KERNEL);
+	journal_written = 0;
 
-	if (mapper == NULL) {
-		printk(PRINT_PREF "kmalloc failed for mapper allocation\n");
-		return -1;
+	for (dir = 0; dir < meta_dir_pages; dir++) {
+		dir_dirty[dir] = 0;
+
+		if (dir_pending[dir] == META_NONE)
+			continue;
+
+		meta_live_move(dir_map[dir], dir_pending[dir]);
+		dir_map[dir] = dir_pending[dir];
+		dir_pending[dir] = META_NONE;
 	}
 
-	byte_mapper = (uint8_t *)mapper;
+	mutex_lock(&mapper_lock);
 
-	j = 0;
+	for (lpage = 0; lpage < meta_lpages; lpage++) {
+		if (lpage_pending[lpage] == META_NONE)
+			continue;
 
-	for (i = mapper_start; i < mapper_start + mapper_pages ; i++) {
-		if (read_disk) {
-			if (read_page(i, byte_mapper + (j) *
-				      meta_config->page_size,
-				      meta_config) != 0) {
-				printk(PRINT_PREF "Read for %lu page failed\n",
-				       i);
-				return -1;
-			}
-			j++;
-		} else {
-			memset(byte_mapper, 0xFF,
-			       mapper_pages * meta_config->page_size);
-		}
+		meta_live_move(lpage_map[lpage], lpage_pending[lpage]);
+		lpage_map[lpage] = lpage_pending[lpage];
+		lpage_pending[lpage] = META_NONE;
+		lpage_dirty[lpage] = 0;
 	}
 
-	project6_fix_free_page_pointer(0);
+	/* The modified pages of the mapper are written back */
+	if (mapper_slots) {
+		list_for_each_entry(slot, &mapper_lru, lru)
+			slot->dirty = false;
+
+		mapper_dirty = 0;
+		mapper_shrink();
+	}
+
+	mutex_unlock(&mapper_lock);
 
 	return 0;
 }
 
 /**
- * @brief Flush the meta-data back to flash
+ * @brief Flush the meta-data back to flash. The ranges modified since the
+ * last flush are appended to the journal, once it is full the modified pages
+ * are written with a new root. kv_sem is held for write, or for read by the
+ * flusher thread once the packed page being filled is sealed.
  *
  * @param config Config of the meta-data
  */
 void project6_flush_meta_data_to_flash(project6_cfg *config)
 {
-	uint64_t total_pages = mapper_pages + bitmap_pages + 1;
-	uint64_t block_count;
-	uint8_t *byte_mapper = (uint8_t *)mapper;
-	size_t i = 0;
-	size_t j = 0;
-
-	if (total_pages % config->pages_per_block)
-		block_count = total_pages / config->pages_per_block + 1;
-	else
-		block_count = total_pages / config->pages_per_block;
+	uint32_t head_block;
+	uint32_t block;
+	uint64_t count;
+	int ret;
 
-	if (erase_block(meta_data_block, block_count,
-			config, metadata_format_callback)) {
-		printk(PRINT_PREF "Erasing the block device failed while flushing\n");
+	/* Nothing was constructed, or nothing changed */
+	if (!lpage_map || (!meta_changes && root_ppage != META_NONE))
 		return;
-	}
 
-	meta_data_block += block_count;
+	/* The mapper must not refer to records which are only in memory */
+	project6_pack_seal();
 
-	if (meta_data_block + block_count >= config->nb_blocks) {
-		meta_data_block = 0;
-	}
+	head_block = meta_head == META_NONE ? META_NONE :
+		(meta_head - 1) / config->pages_per_block;
+
+	/* Nothing committed is left in these blocks */
+	for (block = 0; block < config->nb_blocks; block++)
+		meta_reusable[block] = meta_live[block] == 0 &&
+			block != head_block && block != meta_erasing &&
+			!meta_bad[block];
 
-	project6_create_meta_data(config, meta_data_block);
+	/* The journal does not write the mapper pages back, a root does */
+	if (mapper_crowded())
+		journal_full = true;
 
-	bitmap_start = meta_data_block * config->pages_per_block + 1;
+	if (root_ppage != META_NONE && !journal_full) {
+		journal_compact();
+		count = journal_count_pages();
 
-	mapper_start = bitmap_pages + bitmap_start + 1;
+		if (journal_fits(count)) {
+			ret = journal_write(count);
+
+			if (!ret) {
+				meta_changes = 0;
+				return;
+			}
 
-	for (i = bitmap_start; i < bitmap_start + bitmap_pages ; i++) {
-		if (write_page(i, bitmap + (j) * config->page_size,
-			       config) != 0) {
-			printk(PRINT_PREF "Write for %lu page failed\n", i);
+			/* The root written instead holds the modifications */
+			printk(PRINT_PREF "Journaling the meta-data failed\n");
 		}
-		j++;
 	}
 
-	j = 0;
+	meta_clean(meta_copy_blocks() + 1 + journal_blocks());
 
-	for (i = mapper_start; i < mapper_start + mapper_pages ; i++) {
-		if (write_page(i, byte_mapper + (j) * config->page_size,
-			       config) != 0) {
-			printk(PRINT_PREF "Write for %lu page failed\n", i);
-		}
-		j++;
+	ret = meta_write_pages();
+
+	if (!ret)
+		ret = meta_commit();
+
+	if (ret) {
+		/* The pages written are dropped, the flush is tried again */
+		printk(PRINT_PREF "Flushing the meta-data failed\n");
+		memset(lpage_pending, 0xFF, meta_lpages * sizeof(uint32_t));
+		memset(dir_pending, 0xFF, meta_dir_pages * sizeof(uint32_t));
+		return;
+	}
+
+	meta_changes = 0;
+	journal_nr_ranges = 0;
+	journal_full = false;
+}
+
+/**
+ * @brief Wakes up the flusher thread
+ */
+static void flush_kick(void)
+{
+	if (flush_thread) {
+		atomic_set(&flush_kicked, 1);
+		wake_up_interruptible(&flush_wait);
 	}
 }
 
 /**
- * @brief Flush the meta-data on periodic basis
+ * @brief Flush the meta-data on periodic basis. With the flusher thread
+ * running, it is only woken up early when modifications piled up.
  */
 void project6_flush_meta_data_timely(void)
 {
+	/* Modified pages of the mapper wait in the cache for a root */
+	if (mapper_crowded()) {
+		project6_flush_meta_data_to_flash(&meta_config);
+		return;
+	}
+
+	if (flush_thread) {
+		if (meta_flush_changes && meta_changes >= meta_flush_changes)
+			flush_kick();
+		return;
+	}
 
 	if (old_meta_jiffies == 0)
 		old_meta_jiffies = jiffies;
-	else if (time_before(jiffies, old_meta_jiffies + 1 * HZ / 3))
+	else if (time_before(jiffies, old_meta_jiffies +
+			     msecs_to_jiffies(meta_flush_ms)))
 		return;
 	else
 		old_meta_jiffies = jiffies;
 
-	project6_flush_meta_data_to_flash(&meta_config);
+	project6_flush_meta_data_if_dirty();
+}
+
+/**
+ * @brief Checks if the periodic flush has something to write, without
+ * holding kv_sem
+ *
+ * @return true if the meta-data is dirty and the flush period is over, never
+ * when the flusher thread runs
+ */
+bool project6_meta_data_flush_due(void)
+{
+	if (!meta_changes || flush_thread)
+		return false;
+
+	return old_meta_jiffies == 0 ||
+		!time_before(jiffies, old_meta_jiffies +
+			     msecs_to_jiffies(meta_flush_ms));
+}
+
+/**
+ * @brief Flush the meta-data if it was modified since the last flush
+ */
+void project6_flush_meta_data_if_dirty(void)
+{
+	if (meta_changes)
+		project6_flush_meta_data_to_flash(&meta_config);
+}
+
+/**
+ * @brief Picks a block to be erased ahead of the flushes: nothing committed
+ * is left in it, it is not erased yet and no erase of it failed. Only the blocks a whole copy and
+ * the journal may need are kept erased, the others wait for their turn.
+ *
+ * @return Block number, META_NONE if there is none
+ */
+static uint32_t meta_erase_pick(void)
+{
+	uint32_t ppb = meta_config.pages_per_block;
+	uint32_t head_block = meta_head == META_NONE ? META_NONE :
+		(meta_head - 1) / ppb;
+	uint32_t start = meta_head == META_NONE ? 0 : meta_head / ppb;
+	uint32_t pick = META_NONE;
+	uint64_t ready = 0;
+	uint32_t block;
+	uint32_t i;
+
+	if (!meta_erased)
+		return META_NONE;
+
+	/* In the order the flushes take them */
+	for (i = 1; i <= meta_config.nb_blocks; i++) {
+		block = (start + i) % meta_config.nb_blocks;
+
+		if (meta_live[block] != 0 || block == head_block ||
+		    block == meta_erasing || meta_bad[block])
+			continue;
+
+		if (meta_erased[block])
+			ready++;
+		else if (pick == META_NONE)
+			pick = block;
+	}
+
+	if (ready >= meta_copy_blocks() + 1 + journal_blocks())
+		return META_NONE;
+
+	return pick;
+}
+
+/**
+ * @brief Erases the unused meta-data blocks, so that the flushes find them
+ * ready. kv_sem is only held to pick a block and to account it, the flushes
+ * leave alone the block being erased.
+ */
+static void meta_erase_ahead(void)
+{
+	uint32_t block;
+	int ret;
+
+	while (!kthread_should_stop()) {
+		down_write(&kv_sem);
+		block = meta_erase_pick();
+		meta_erasing = block;
+		up_write(&kv_sem);
+
+		if (block == META_NONE)
+			return;
+
+		ret = erase_block(block, 1, &meta_config,
+				  metadata_format_callback);
+
+		if (ret)
+			printk(PRINT_PREF "Erasing meta-data block %u ahead failed\n",
+			       block);
+
+		/* A failed block is left out of the next picks */
+		down_write(&kv_sem);
+		meta_erasing = META_NONE;
+		if (meta_erased) {
+			if (ret)
+				meta_bad[block] = 1;
+			else
+				meta_erased[block] = 1;
+		}
+		up_write(&kv_sem);
+	}
+}
+
+/**
+ * @brief Flusher thread. The writers are held off by kv_sem while the
+ * modifications are written, so that the flush sees a consistent state, the
+ * lookups go on. The blocks freed are erased afterwards, out of the flushes.
+ *
+ * @param data Unused
+ *
+ * @return 0 when stopped
+ */
+static int flush_thread_fn(void *data)
+{
+	while (!kthread_should_stop()) {
+		wait_event_interruptible_timeout(flush_wait,
+						 atomic_read(&flush_kicked) ||
+						 kthread_should_stop(),
+						 msecs_to_jiffies(meta_flush_ms));
+
+		if (kthread_should_stop())
+			break;
+
+		atomic_set(&flush_kicked, 0);
+
+		/* The lookups read the packed page being filled, it is sealed
+		 * before they are let in. The writers stay out of the flush */
+		down_write(&kv_sem);
+		project6_pack_seal();
+		downgrade_write(&kv_sem);
+
+		project6_flush_meta_data_if_dirty();
+		up_read(&kv_sem);
+
+		meta_erase_ahead();
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Starts the meta-data flusher thread
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_meta_flusher_start(void)
+{
+	struct task_struct *thread;
+
+	thread = kthread_run(flush_thread_fn, NULL, "project6_flush");
+
+	if (IS_ERR(thread)) {
+		printk(PRINT_PREF "Starting the flusher thread failed\n");
+		return PTR_ERR(thread);
+	}
+
+	flush_thread = thread;
+
+	return 0;
+}
+
+/**
+ * @brief Stops the meta-data flusher thread, the requests flush the
+ * meta-data by themselves again
+ */
+void project6_meta_flusher_stop(void)
+{
+	if (flush_thread)
+		kthread_stop(flush_thread);
+
+	flush_thread = NULL;
+}
+
+/**
+ * @brief Drops the in memory meta-data and reads back the last flushed
+ * copy. Pages programmed since that flush are marked invalid, they cannot
+ * be used again before their block is erased.
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_reload_meta_data(void)
+{
+	uint64_t num_pages = data_config.nb_blocks *
+		data_config.pages_per_block;
+	uint64_t ppage;
+	uint8_t *old_bitmap;
+	uint8_t *old_erased;
+	uint8_t *old_bad;
+	int ret;
+
+	old_bitmap = vmalloc(regions[0].bytes);
+	old_erased = vmalloc(meta_config.nb_blocks);
+	old_bad = vmalloc(meta_config.nb_blocks);
+
+	if (!old_bitmap || !old_erased || !old_bad) {
+		printk(PRINT_PREF "vmalloc failed for the bitmap copy\n");
+		if (old_bitmap)
+			vfree(old_bitmap);
+		if (old_erased)
+			vfree(old_erased);
+		if (old_bad)
+			vfree(old_bad);
+		return -ENOMEM;
+	}
+
+	memcpy(old_bitmap, bitmap, regions[0].bytes);
+	memcpy(old_erased, meta_erased, meta_config.nb_blocks);
+	memcpy(old_bad, meta_bad, meta_config.nb_blocks);
+
+	ret = project6_construct_meta_data(&meta_config, &data_config, true);
+
+	if (ret) {
+		vfree(old_bitmap);
+		vfree(old_erased);
+		vfree(old_bad);
+		return ret;
+	}
+
+	/* The flash cannot tell the blocks erased ahead, nor the failed ones */
+	memcpy(meta_erased, old_erased, meta_config.nb_blocks);
+	memcpy(meta_bad, old_bad, meta_config.nb_blocks);
+	vfree(old_erased);
+	vfree(old_bad);
+
+	for (ppage = 0; ppage < num_pages; ppage++) {
+		if (project6_get_ppage_state(ppage) != PAGE_FREE ||
+		    ((old_bitmap[ppage / 4] >> ((ppage % 4) * 2)) & 0x3) ==
+		    PAGE_FREE)
+			continue;
+
+		project6_set_ppage_state(ppage, PAGE_INVALID);
+		total_written_page++;
+	}
+
+	vfree(old_bitmap);
+
+	project6_free_pool_rebuild();
+
+	return 0;
 }
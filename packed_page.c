@@ -0,0 +1,497 @@
+/*
+ * Slotted pages packing several small key/value records
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/mtd/mtd.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include "core.h"
+
+#define PRINT_PREF KERN_INFO "PACKED_PAGE "
+
+/*
+ * Layout of a packed page:
+ *
+ * | marker | slot count | slot directory ...  free ... records |
+ *
+ * The directory grows from the header towards the end of the page, the
+ * records (key followed by value) grow from the end of the page backwards.
+ */
+#define PACK_HEADER_SIZE 8
+
+/**
+ * @brief Entry of the slot directory
+ */
+struct packed_slot {
+	uint32_t vpage;		/* owner of the slot */
+	uint16_t offset;	/* offset of the key in the page */
+	uint16_t key_len;
+	uint16_t val_len;
+	uint16_t reserved;
+};
+
+/**
+ * @brief Number of live slots per packed ppage, 0 for other pages. Rebuilt
+ * from the mapper at mount.
+ */
+uint8_t *slot_live = NULL;
+
+/* Packed page being filled in memory, written on flash once sealed */
+static uint8_t *pack_buffer = NULL;
+static uint64_t pack_ppage = PAGE_UNALLOCATED;
+static uint32_t pack_data_start;
+
+/* Used to compact packed pages during migration */
+static uint8_t *pack_scratch = NULL;
+
+/*
+ * Bumped whenever a ppage starts holding another packed page, the copies
+ * kept by the contexts are only valid for the generation they were read at
+ */
+static uint64_t packed_gen = 1;
+
+/**
+ * @brief Checks if a record is small enough to be packed
+ *
+ * @param key_len Length of the key
+ * @param val_len Length of the value
+ *
+ * @return true if the record goes to a packed page
+ */
+bool project6_is_packed_record(uint32_t key_len, uint32_t val_len)
+{
+	return key_len + val_len + sizeof(struct packed_slot) <=
+		data_config.page_size / PACK_RECORD_FRACTION;
+}
+
+/**
+ * @brief Counts the packed pages the small records of a batch fill at most
+ *
+ * @param count Number of operations
+ * @param keys Keys of the operations
+ * @param vals Values of the sets, NULL for a delete
+ *
+ * @return Number of pages
+ */
+uint64_t project6_pack_pages_needed(int count, const char **keys,
+				    const char **vals)
+{
+	uint64_t pages = 0;
+	uint32_t slots = PACK_MAX_SLOTS;
+	uint32_t data_start = 0;
+	uint32_t key_len;
+	uint32_t val_len;
+	int i;
+
+	/*
+	 * Filled the way pack_append does, starting from an empty page. The
+	 * page being filled can only take more of them, never fewer pages.
+	 */
+	for (i = 0; i < count; i++) {
+		if (!vals[i])
+			continue;
+
+		key_len = strlen(keys[i]);
+		val_len = strlen(vals[i]);
+
+		if (!project6_is_packed_record(key_len, val_len))
+			continue;
+
+		if (slots == PACK_MAX_SLOTS ||
+		    PACK_HEADER_SIZE + (slots + 1) * sizeof(struct packed_slot) +
+		    key_len + val_len > data_start) {
+			pages++;
+			slots = 0;
+			data_start = data_config.page_size;
+		}
+
+		slots++;
+		data_start -= key_len + val_len;
+	}
+
+	return pages;
+}
+
+/**
+ * @brief Gets the slot directory of a packed page
+ *
+ * @param page Buffer holding the packed page
+ *
+ * @return Pointer to the first directory entry
+ */
+static struct packed_slot *pack_dir(uint8_t *page)
+{
+	return (struct packed_slot *)(page + PACK_HEADER_SIZE);
+}
+
+/**
+ * @brief Initializes an empty packed page in the given buffer
+ *
+ * @param page Buffer of page size
+ */
+static void pack_init_page(uint8_t *page)
+{
+	uint32_t marker = PACKED_PAGE;
+	uint32_t count = 0;
+
+	memset(page, 0x0, data_config.page_size);
+
+	memcpy(page, &marker, sizeof(uint32_t));
+	memcpy(page + 4, &count, sizeof(uint32_t));
+}
+
+/**
+ * @brief Appends a record into a packed page
+ *
+ * @param page Buffer holding the packed page
+ * @param data_start Start of the record area, updated on success
+ * @param vpage Owner of the record
+ * @param key Key of the record
+ * @param key_len Length of the key
+ * @param val Value of the record
+ * @param val_len Length of the value
+ *
+ * @return Slot of the record, -ENOSPC if it does not fit
+ */
+static int pack_append(uint8_t *page, uint32_t *data_start, uint64_t vpage,
+		       const char *key, uint32_t key_len,
+		       const char *val, uint32_t val_len)
+{
+	uint32_t count = *((uint32_t *)(page + 4));
+	struct packed_slot *slot = pack_dir(page) + count;
+	uint32_t dir_end = PACK_HEADER_SIZE +
+		(count + 1) * sizeof(struct packed_slot);
+
+	if (count == PACK_MAX_SLOTS ||
+	    dir_end + key_len + val_len > *data_start)
+		return -ENOSPC;
+
+	*data_start -= key_len + val_len;
+
+	memcpy(page + *data_start, key, key_len);
+	memcpy(page + *data_start + key_len, val, val_len);
+
+	slot->vpage = vpage;
+	slot->offset = *data_start;
+	slot->key_len = key_len;
+	slot->val_len = val_len;
+	slot->reserved = 0;
+
+	*((uint32_t *)(page + 4)) = count + 1;
+
+	return count;
+}
+
+/**
+ * @brief Writes the packed page being filled on flash
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_pack_seal(void)
+{
+	uint64_t ppage = pack_ppage;
+	int ret;
+
+	if (ppage == PAGE_UNALLOCATED)
+		return 0;
+
+	pack_ppage = PAGE_UNALLOCATED;
+
+	ret = write_page(ppage, pack_buffer, &data_config);
+
+	if (ret)
+		printk(PRINT_PREF "Writing packed page 0x%llx failed\n", ppage);
+
+	/* Every record was deleted before the page reached the flash */
+	if (slot_live[ppage] == 0)
+		project6_release_packed_page(ppage);
+
+	return ret;
+}
+
+/**
+ * @brief Stores a small record into the packed page being filled
+ *
+ * @param vpage Free vpage which identifies the record
+ * @param key Key of the record
+ * @param key_len Length of the key
+ * @param val Value of the record
+ * @param val_len Length of the value
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_pack_record(uint64_t vpage, const char *key, uint32_t key_len,
+			 const char *val, uint32_t val_len)
+{
+	int slot = -ENOSPC;
+	int ret;
+
+	if (pack_ppage != PAGE_UNALLOCATED)
+		slot = pack_append(pack_buffer, &pack_data_start, vpage,
+				   key, key_len, val, val_len);
+
+	if (slot == -ENOSPC) {
+		ret = project6_pack_seal();
+
+		if (ret)
+			return ret;
+
+		ret = project6_create_packed_page(&pack_ppage);
+
+		packed_gen++;
+
+		if (ret) {
+			pack_ppage = PAGE_UNALLOCATED;
+			return ret;
+		}
+
+		pack_init_page(pack_buffer);
+		pack_data_start = data_config.page_size;
+
+		slot = pack_append(pack_buffer, &pack_data_start, vpage,
+				   key, key_len, val, val_len);
+
+		if (slot < 0)
+			return slot;
+	}
+
+	return project6_map_slot(vpage, pack_ppage, slot);
+}
+
+/**
+ * @brief Reads a record from a packed page, the page stays in the context
+ * so that neighbouring records are served without reading the flash
+ *
+ * @param ctx Context of the caller
+ * @param vpage Vpage of the record
+ * @param key Key expected in the record
+ * @param val Buffer for the value, can be NULL
+ *
+ * @return 0 if the key matches, -1 otherwise
+ */
+int project6_read_packed(project6_ctx *ctx, uint64_t vpage, const char *key,
+			 char *val)
+{
+	uint64_t ppage;
+	uint8_t *page;
+	struct packed_slot *slot;
+	uint32_t key_len = strlen(key);
+	int index = project6_get_vpage_slot(vpage, &ppage);
+
+	if (index < 0)
+		return -1;
+
+	/* Records of the page being filled are not on flash yet */
+	if (ppage == pack_ppage) {
+		page = pack_buffer;
+	} else if (ppage == ctx->packed_ppage &&
+		   ctx->packed_gen == packed_gen) {
+		page = ctx->packed_buffer;
+	} else {
+		ctx->packed_ppage = PAGE_UNALLOCATED;
+		if (read_page(ppage, ctx->packed_buffer, &data_config)) {
+			printk(PRINT_PREF "Reading packed page 0x%llx failed\n",
+			       ppage);
+			return -1;
+		}
+		ctx->packed_ppage = ppage;
+		ctx->packed_gen = packed_gen;
+		page = ctx->packed_buffer;
+	}
+
+	if (*((uint32_t *)page) != PACKED_PAGE ||
+	    index >= *((uint32_t *)(page + 4)))
+		return -1;
+
+	slot = pack_dir(page) + index;
+
+	if (slot->vpage != vpage || slot->key_len != key_len ||
+	    memcmp(page + slot->offset, key, key_len))
+		return -1;
+
+	if (val) {
+		memcpy(val, page + slot->offset + key_len, slot->val_len);
+		val[slot->val_len] = '\0';
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Accounts a dead slot of a packed page
+ *
+ * @param ppage Packed page of the slot
+ */
+void project6_packed_slot_invalid(uint64_t ppage)
+{
+	slot_live[ppage]--;
+
+	if (slot_live[ppage] == 0 && ppage != pack_ppage)
+		project6_release_packed_page(ppage);
+}
+
+/**
+ * @brief Moves the live records of a packed page to a page outside the
+ * block, dropping the dead slots
+ *
+ * @param ppage Packed page to be migrated
+ * @param blk_number Block being garbage collected
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_migrate_packed_page(uint64_t ppage, uint64_t blk_number)
+{
+	struct packed_slot *slot;
+	uint64_t npage;
+	uint64_t owner;
+	uint64_t owner_page;
+	uint32_t data_start = data_config.page_size;
+	uint32_t count;
+	uint32_t i;
+	int index;
+	int ret;
+
+	ret = read_page(ppage, page_buffer, &data_config);
+
+	if (ret) {
+		printk(PRINT_PREF "Reading packed page for migration failed\n");
+		return ret;
+	}
+
+	count = *((uint32_t *)(page_buffer + 4));
+
+	/* The records cannot be found, the block must not be erased */
+	if (*((uint32_t *)page_buffer) != PACKED_PAGE ||
+	    count > PACK_MAX_SLOTS) {
+		printk(PRINT_PREF "Packed page 0x%llx has a bad header\n", ppage);
+		return -EIO;
+	}
+
+	ret = project6_create_packed_page_new_block(&npage, blk_number);
+
+	if (ret) {
+		printk(PRINT_PREF "No page to migrate packed page\n");
+		return ret;
+	}
+
+	packed_gen++;
+
+	pack_init_page(pack_scratch);
+
+	for (i = 0; i < count; i++) {
+		slot = pack_dir(page_buffer) + i;
+		owner = slot->vpage;
+
+		index = project6_get_vpage_slot(owner, &owner_page);
+
+		/* Whether the slot is live is unknown, nothing is moved */
+		if (index == -EIO) {
+			project6_set_ppage_state(npage, PAGE_INVALID);
+			return index;
+		}
+
+		if (index != i || owner_page != ppage)
+			continue;
+
+		index = pack_append(pack_scratch, &data_start, owner,
+				    page_buffer + slot->offset, slot->key_len,
+				    page_buffer + slot->offset + slot->key_len,
+				    slot->val_len);
+
+		/* Compacting can only shrink the page */
+		if (index < 0) {
+			project6_set_ppage_state(npage, PAGE_INVALID);
+			return index;
+		}
+	}
+
+	ret = write_page(npage, pack_scratch, &data_config);
+
+	if (ret) {
+		/* The records stay where they are, the step is retried later */
+		printk(PRINT_PREF "Writing packed page for migration failed\n");
+		project6_set_ppage_state(npage, PAGE_INVALID);
+		return ret;
+	}
+
+	/* Remapped only once the copy is on flash */
+	count = *((uint32_t *)(pack_scratch + 4));
+	slot = pack_dir(pack_scratch);
+
+	for (i = 0; i < count; i++, slot++) {
+		/* The records left behind are still read from the old page */
+		ret = project6_map_slot(slot->vpage, npage, i);
+
+		if (ret)
+			return ret;
+
+		slot_live[ppage]--;
+	}
+
+	/* Owned by nobody anymore, reclaimed with its block */
+	project6_set_ppage_state(ppage, PAGE_INVALID);
+
+	return 0;
+}
+
+/**
+ * @brief Releases the packed page state
+ */
+void project6_packed_destroy(void)
+{
+	if (slot_live)
+		vfree(slot_live);
+	if (pack_buffer)
+		kfree(pack_buffer);
+	if (pack_scratch)
+		kfree(pack_scratch);
+
+	slot_live = NULL;
+	pack_buffer = NULL;
+	pack_scratch = NULL;
+	pack_ppage = PAGE_UNALLOCATED;
+	packed_gen++;
+}
+
+/**
+ * @brief Allocates the packed page state, the live slots are counted by
+ * project6_rmap_init
+ *
+ * @param num_pages Number of pages in the data partition
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_packed_init(uint64_t num_pages)
+{
+	project6_packed_destroy();
+
+	slot_live = vzalloc(num_pages);
+	pack_buffer = kmalloc(data_config.page_size, GFP_KERNEL);
+	pack_scratch = kmalloc(data_config.page_size, GFP_KERNEL);
+
+	if (!slot_live || !pack_buffer || !pack_scratch) {
+		printk(PRINT_PREF "Allocation failed for packed pages\n");
+		project6_packed_destroy();
+		return -ENOMEM;
+	}
+
+	return 0;
+}
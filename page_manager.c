@@ -23,51 +23,663 @@
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/jiffies.h>
+#include <linux/vmalloc.h>
 #include "core.h"
 
 #define PRINT_PREF KERN_INFO "PAGE_MANAGER"
 
-static uint64_t current_free_page = 0xDEADBEEF;
+/**
+ * @brief Page counts of each block, maintained with the bitmap
+ */
+project6_block_info *block_info = NULL;
+
+/* Free pages of the data partition */
+static uint64_t total_free_pages;
+
+/* Vpages which do not map any record */
+static uint64_t total_free_vpages;
+
+/* Counts the programmed pages, dates the blocks for garbage collection */
+static uint32_t write_clock;
+
+/* No block is open for writing */
+#define BLOCK_NONE 0xFFFFFFFFFFFFFFFFULL
+
+/* Write frontiers, each fills its own open block */
+#define FRONTIER_USER 0
+#define FRONTIER_GC 1
+#define NB_FRONTIERS 2
 
+/* Position of a block which is not in the free pool */
+#define POOL_NONE 0xFFFFFFFF
+
+/* Orders of the free pool */
+#define POOL_LEAST_WORN 0
+#define POOL_MOST_WORN 1
+#define NB_POOL_HEAPS 2
+
+/*
+ * Pool of the blocks holding free pages, kept in two binary heaps of block
+ * numbers: by increasing and by decreasing erase count. Blocks as worn as
+ * each other come out in the order they were queued. A block is queued at
+ * most once and the open blocks are never queued.
+ */
+static uint32_t *pool_heap[NB_POOL_HEAPS] = { NULL, NULL };
+static uint32_t *pool_pos[NB_POOL_HEAPS] = { NULL, NULL };
+static uint64_t *pool_seq = NULL;
+static uint64_t pool_clock;
+static uint64_t free_count;
 
 /**
- * @brief Finds a free page from the given page
+ * @brief Open block the pages of a frontier are given from, and the next
+ * page to look at in it
+ */
+struct write_frontier {
+	uint64_t open_block;
+	uint64_t write_pointer;
+};
+
+/*
+ * Records written by the users and copies made by the garbage collection
+ * fill different blocks. The copies are the data which outlived a victim,
+ * kept apart from the hot records their blocks go invalid together.
+ */
+static struct write_frontier frontiers[NB_FRONTIERS];
+
+/* Block being garbage collected, no page is given from it */
+static uint64_t held_block = BLOCK_NONE;
+
+/* No vpage in the reverse map */
+#define RMAP_NONE 0xFFFFFFFF
+
+/*
+ * Reverse map, vpage last mapped at each ppage. Rebuilt from the mapper at
+ * mount, vpages fit in 32 bits as for the key index.
+ */
+static uint32_t *rmap = NULL;
+
+/**
+ * @brief Tells if a block comes out of a heap of the free pool before
+ * another one
+ *
+ * @param heap POOL_LEAST_WORN or POOL_MOST_WORN
+ * @param a Block number
+ * @param b Block number
  *
- * @param ppage Offset from which next free page is found
+ * @return true if a comes first
  */
-void project6_fix_free_page_pointer(uint64_t ppage)
+static bool pool_before(int heap, uint32_t a, uint32_t b)
 {
-	uint64_t i = 0;
-	uint8_t status;
-	uint64_t num_pages = data_config.nb_blocks *
-		data_config.pages_per_block;
+	uint32_t erases_a = block_info[a].erase_count;
+	uint32_t erases_b = block_info[b].erase_count;
 
-	/* To wrap around */
-	if (ppage >= num_pages)
-		ppage = 0;
+	if (erases_a != erases_b)
+		return heap == POOL_LEAST_WORN ? erases_a < erases_b :
+			erases_a > erases_b;
 
-	while (i < num_pages) {
+	return pool_seq[a] < pool_seq[b];
+}
+
+/**
+ * @brief Stores a block at a position of a heap of the free pool
+ *
+ * @param heap Heap index
+ * @param pos Position in the heap
+ * @param block Block number
+ */
+static void pool_place(int heap, uint64_t pos, uint32_t block)
+{
+	pool_heap[heap][pos] = block;
+	pool_pos[heap][block] = pos;
+}
+
+/**
+ * @brief Moves a block up a heap of the free pool until its parent comes
+ * before it
+ *
+ * @param heap Heap index
+ * @param pos Position of the block in the heap
+ */
+static void pool_sift_up(int heap, uint64_t pos)
+{
+	uint32_t block = pool_heap[heap][pos];
+	uint64_t parent;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+
+		if (!pool_before(heap, block, pool_heap[heap][parent]))
+			break;
+
+		pool_place(heap, pos, pool_heap[heap][parent]);
+		pos = parent;
+	}
+
+	pool_place(heap, pos, block);
+}
+
+/**
+ * @brief Moves a block down a heap of the free pool until it comes before
+ * its children
+ *
+ * @param heap Heap index
+ * @param pos Position of the block in the heap
+ * @param count Number of blocks in the heap
+ */
+static void pool_sift_down(int heap, uint64_t pos, uint64_t count)
+{
+	uint32_t block = pool_heap[heap][pos];
+	uint64_t child;
+
+	while ((child = 2 * pos + 1) < count) {
+		if (child + 1 < count &&
+		    pool_before(heap, pool_heap[heap][child + 1],
+				pool_heap[heap][child]))
+			child++;
+
+		if (!pool_before(heap, pool_heap[heap][child], block))
+			break;
+
+		pool_place(heap, pos, pool_heap[heap][child]);
+		pos = child;
+	}
+
+	pool_place(heap, pos, block);
+}
 
-		status = project6_get_ppage_state(ppage);
+/**
+ * @brief Inserts a block in both heaps of the free pool, keeping its
+ * queuing date
+ *
+ * @param block Block number
+ */
+static void pool_link(uint64_t block)
+{
+	int heap;
+
+	for (heap = 0; heap < NB_POOL_HEAPS; heap++) {
+		pool_place(heap, free_count, block);
+		pool_sift_up(heap, free_count);
+	}
+
+	free_count++;
+}
+
+/**
+ * @brief Removes a block from both heaps of the free pool
+ *
+ * @param block Block number, in the pool
+ */
+static void pool_unlink(uint64_t block)
+{
+	uint64_t last = free_count - 1;
+	uint32_t moved;
+	uint64_t pos;
+	int heap;
+
+	for (heap = 0; heap < NB_POOL_HEAPS; heap++) {
+		pos = pool_pos[heap][block];
+		pool_pos[heap][block] = POOL_NONE;
+
+		if (pos == last)
+			continue;
+
+		/* The last block of the heap takes the place of the removed one */
+		moved = pool_heap[heap][last];
+		pool_place(heap, pos, moved);
+		pool_sift_down(heap, pos, last);
+		pool_sift_up(heap, pool_pos[heap][moved]);
+	}
+
+	free_count--;
+}
+
+/**
+ * @brief Queues a block at the tail of the free pool
+ *
+ * @param block Block holding free pages
+ */
+static void pool_push(uint64_t block)
+{
+	if (pool_pos[POOL_LEAST_WORN][block] != POOL_NONE)
+		return;
+
+	pool_seq[block] = pool_clock++;
+	pool_link(block);
+}
+
+/**
+ * @brief Takes a block of the free pool, the least erased one or the most
+ * erased one. Blocks as worn as each other are taken in FIFO order.
+ *
+ * @param most_worn true to take the most erased block
+ * @param avoid Block which must not be taken, BLOCK_NONE for any
+ *
+ * @return Block number, BLOCK_NONE if the pool has no block to give
+ */
+static uint64_t pool_pop(bool most_worn, uint64_t avoid)
+{
+	int heap = most_worn ? POOL_MOST_WORN : POOL_LEAST_WORN;
+	uint64_t block = BLOCK_NONE;
+	uint64_t skipped[2];
+	int nb_skipped = 0;
+	uint64_t top;
+
+	/* At most the avoided and the held blocks are set aside */
+	while (free_count) {
+		top = pool_heap[heap][0];
+		pool_unlink(top);
 
-		if (status == PAGE_FREE) {
-			/* If back to previous free page,
-			 * then we dont have any free page */
-			if (ppage == current_free_page
-			    && current_free_page)
-				break;
-			current_free_page = ppage;
-			return;
+		if (top != avoid && top != held_block) {
+			block = top;
+			break;
 		}
 
-		ppage = (ppage + 1) % num_pages;
+		skipped[nb_skipped++] = top;
+	}
+
+	while (nb_skipped)
+		pool_link(skipped[--nb_skipped]);
 
-		i++;
+	return block;
+}
+
+/**
+ * @brief Closes the open block of a frontier, the pool keeps it if it still
+ * holds free pages
+ *
+ * @param front Frontier to be closed
+ */
+static void frontier_close(struct write_frontier *front)
+{
+	if (front->open_block != BLOCK_NONE &&
+	    block_info[front->open_block].free)
+		pool_push(front->open_block);
+
+	front->open_block = BLOCK_NONE;
+}
+
+/**
+ * @brief Takes the next free page from the open block of a frontier,
+ * opening a block of the pool when the open one is full
+ *
+ * @param ppage Pointer where the free page is returned
+ * @param frontier FRONTIER_USER or FRONTIER_GC
+ * @param avoid Block which must not be used, BLOCK_NONE for any
+ *
+ * @return 0 on success, -ENOMEM if no block has free pages
+ */
+static int next_free_page(uint64_t *ppage, int frontier, uint64_t avoid)
+{
+	struct write_frontier *front = &frontiers[frontier];
+	struct write_frontier *other;
+	uint64_t end;
+	int i;
+
+	if (front->open_block == avoid || front->open_block == held_block)
+		frontier_close(front);
+
+	while (true) {
+		if (front->open_block != BLOCK_NONE &&
+		    block_info[front->open_block].free == 0)
+			front->open_block = BLOCK_NONE;
+
+		if (front->open_block != BLOCK_NONE) {
+			end = (front->open_block + 1) *
+				data_config.pages_per_block;
+
+			while (front->write_pointer < end &&
+			       project6_get_ppage_state(front->write_pointer) !=
+			       PAGE_FREE)
+				front->write_pointer++;
+
+			if (front->write_pointer < end) {
+				*ppage = front->write_pointer++;
+				return 0;
+			}
+
+			front->open_block = BLOCK_NONE;
+		}
+
+		/* Dynamic wear leveling, the hot user writes go to the least
+		 * worn blocks and the cold copies to the most worn ones */
+		front->open_block = pool_pop(frontier == FRONTIER_GC, avoid);
+
+		/* Out of blocks, the frontiers share what is left */
+		for (i = 0; i < NB_FRONTIERS &&
+		     front->open_block == BLOCK_NONE; i++) {
+			other = &frontiers[i];
+
+			if (other == front ||
+			    other->open_block == BLOCK_NONE ||
+			    other->open_block == avoid ||
+			    other->open_block == held_block ||
+			    block_info[other->open_block].free == 0)
+				continue;
+
+			front->open_block = other->open_block;
+			other->open_block = BLOCK_NONE;
+		}
+
+		if (front->open_block == BLOCK_NONE)
+			return -ENOMEM;
+
+		front->write_pointer = front->open_block *
+			data_config.pages_per_block;
 	}
+}
+
+/**
+ * @brief Gives an erased block back to the free pool and counts the erase
+ *
+ * @param block Block which was erased
+ */
+void project6_free_block_put(uint64_t block)
+{
+	int i;
+
+	/* The heaps are ordered by the erase count about to change */
+	if (pool_pos[POOL_LEAST_WORN][block] != POOL_NONE)
+		pool_unlink(block);
+
+	block_info[block].erase_count++;
+	project6_mark_meta_data_dirty(&block_info[block],
+				      sizeof(block_info[block]));
+
+	for (i = 0; i < NB_FRONTIERS; i++) {
+		/* Written again from its first page */
+		if (frontiers[i].open_block == block) {
+			frontiers[i].write_pointer =
+				block * data_config.pages_per_block;
+			break;
+		}
+	}
+
+	if (i == NB_FRONTIERS)
+		pool_push(block);
+
+	data_config.read_only = 0;
+}
+
+/**
+ * @brief Keeps the free pages of a block from being given while the block
+ * is garbage collected
+ *
+ * @param block Block being collected
+ */
+void project6_free_pool_hold(uint64_t block)
+{
+	held_block = block;
+}
+
+/**
+ * @brief Lets the pages of the held block be given again
+ */
+void project6_free_pool_release(void)
+{
+	held_block = BLOCK_NONE;
+}
+
+/**
+ * @brief Takes a block out of use after its erase failed, its pages are
+ * neither given nor counted as free anymore
+ *
+ * @param block Block which could not be erased
+ */
+void project6_block_mark_bad(uint64_t block)
+{
+	uint64_t ppage = block * data_config.pages_per_block;
+	uint64_t end = ppage + data_config.pages_per_block;
+	int i;
+
+	if (pool_pos[POOL_LEAST_WORN][block] != POOL_NONE)
+		pool_unlink(block);
+
+	for (i = 0; i < NB_FRONTIERS; i++)
+		if (frontiers[i].open_block == block)
+			frontiers[i].open_block = BLOCK_NONE;
+
+	/* Set first, the garbage collection does not take the block back */
+	block_info[block].bad = 1;
+
+	for (; ppage < end; ppage++)
+		project6_set_ppage_state(ppage, PAGE_INVALID);
+
+	printk(PRINT_PREF "Block %llu is bad, %llu free pages left\n", block,
+	       total_free_pages);
+}
+
+/**
+ * @brief Refills the free pool from the bitmap, after the bitmap was loaded
+ * or replaced
+ */
+void project6_free_pool_rebuild(void)
+{
+	uint64_t block;
+	int i;
+
+	free_count = 0;
+	pool_clock = 0;
+
+	for (i = 0; i < NB_FRONTIERS; i++)
+		frontiers[i].open_block = BLOCK_NONE;
+	for (i = 0; i < NB_POOL_HEAPS; i++)
+		memset(pool_pos[i], 0xFF,
+		       data_config.nb_blocks * sizeof(uint32_t));
+
+	for (block = 0; block < data_config.nb_blocks; block++)
+		if (block_info[block].free)
+			pool_push(block);
+
 	/* Move to read only mode if no free page */
-	data_config.read_only = 1;
+	data_config.read_only = free_count == 0;
 }
 
+/**
+ * @brief Releases the free pool
+ */
+void project6_free_pool_destroy(void)
+{
+	int i;
+
+	for (i = 0; i < NB_POOL_HEAPS; i++) {
+		if (pool_heap[i])
+			vfree(pool_heap[i]);
+		if (pool_pos[i])
+			vfree(pool_pos[i]);
+
+		pool_heap[i] = NULL;
+		pool_pos[i] = NULL;
+	}
+
+	if (pool_seq)
+		vfree(pool_seq);
+
+	pool_seq = NULL;
+	free_count = 0;
+	held_block = BLOCK_NONE;
+
+	for (i = 0; i < NB_FRONTIERS; i++)
+		frontiers[i].open_block = BLOCK_NONE;
+}
+
+/**
+ * @brief Allocates the free pool and fills it from the bitmap
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_free_pool_init(void)
+{
+	int i;
+
+	project6_free_pool_destroy();
+
+	for (i = 0; i < NB_POOL_HEAPS; i++) {
+		pool_heap[i] = vmalloc(data_config.nb_blocks * sizeof(uint32_t));
+		pool_pos[i] = vmalloc(data_config.nb_blocks * sizeof(uint32_t));
+	}
+	pool_seq = vmalloc(data_config.nb_blocks * sizeof(uint64_t));
+
+	if (!pool_heap[POOL_LEAST_WORN] || !pool_pos[POOL_LEAST_WORN] ||
+	    !pool_heap[POOL_MOST_WORN] || !pool_pos[POOL_MOST_WORN] ||
+	    !pool_seq) {
+		printk(PRINT_PREF "vmalloc failed for the free pool\n");
+		project6_free_pool_destroy();
+		return -ENOMEM;
+	}
+
+	project6_free_pool_rebuild();
+
+	return 0;
+}
+
+/**
+ * @brief Gets the vpage whose record fills the given ppage
+ *
+ * @param ppage Physical page number
+ * @param owner Filled with the owner vpage, PAGE_UNALLOCATED if the page is
+ * not mapped as a whole, like migrated and packed pages
+ *
+ * @return 0 on success, -EIO if the mapper cannot be read
+ */
+int project6_get_ppage_owner(uint64_t ppage, uint64_t *owner)
+{
+	uint32_t vpage = rmap[ppage];
+	uint64_t entry;
+	int ret;
+
+	*owner = PAGE_UNALLOCATED;
+
+	if (vpage == RMAP_NONE)
+		return 0;
+
+	ret = project6_get_vpage_entry(vpage, &entry);
+
+	if (ret)
+		return ret;
+
+	/* Entries are left behind when a vpage moves, the mapper decides */
+	if (entry == ppage)
+		*owner = vpage;
+
+	return 0;
+}
+
+/**
+ * @brief Releases the reverse map
+ */
+void project6_rmap_destroy(void)
+{
+	if (rmap)
+		vfree(rmap);
+
+	rmap = NULL;
+}
+
+/**
+ * @brief Checks if a mapper entry leaves its vpage available
+ *
+ * @param entry Mapper entry
+ *
+ * @return true if no record is mapped
+ */
+static bool vpage_entry_free(uint64_t entry)
+{
+	return entry == PAGE_UNALLOCATED || entry == PAGE_GARBAGE_RECLAIMED;
+}
+
+/**
+ * @brief Sets the mapper entry of a vpage, and accounts the free vpages
+ *
+ * @param vpage Vpage to be updated
+ * @param entry New mapper entry
+ *
+ * @return 0 on success, -EIO if the mapper cannot be updated
+ */
+int project6_set_vpage_mapping(uint64_t vpage, uint64_t entry)
+{
+	uint64_t old;
+	bool was_free;
+	int ret;
+
+	ret = project6_get_vpage_entry(vpage, &old);
+
+	if (!ret)
+		ret = project6_put_vpage_entry(vpage, entry);
+
+	if (ret) {
+		printk(PRINT_PREF "Mapping of vpage %llu cannot be updated\n",
+		       vpage);
+		return ret;
+	}
+
+	was_free = vpage_entry_free(old);
+
+	if (was_free && !vpage_entry_free(entry))
+		total_free_vpages--;
+	else if (!was_free && vpage_entry_free(entry))
+		total_free_vpages++;
+
+	return 0;
+}
+
+/**
+ * @brief Counts the vpages which do not map any record
+ *
+ * @return Number of free vpages
+ */
+uint64_t project6_count_free_vpages(void)
+{
+	return total_free_vpages;
+}
+
+/**
+ * @brief Allocates the reverse map and fills it from the mapper, counting
+ * the free vpages and the live slots of the packed pages as well, so the
+ * mapper is read once
+ *
+ * @param num_pages Number of pages in the data partition
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_rmap_init(uint64_t num_pages)
+{
+	uint64_t vpage;
+	uint64_t entry;
+	int ret;
+
+	project6_rmap_destroy();
+
+	rmap = vmalloc(num_pages * sizeof(uint32_t));
+
+	if (!rmap) {
+		printk(PRINT_PREF "vmalloc failed for the reverse map\n");
+		return -ENOMEM;
+	}
+
+	memset(rmap, 0xFF, num_pages * sizeof(uint32_t));
+
+	total_free_vpages = 0;
+
+	for (vpage = 0; vpage < num_pages; vpage++) {
+		ret = project6_get_vpage_entry(vpage, &entry);
+
+		if (ret)
+			return ret;
+
+		if (vpage_entry_free(entry)) {
+			total_free_vpages++;
+			continue;
+		}
+
+		if (MAPPER_SLOT(entry))
+			slot_live[MAPPER_PPAGE(entry)]++;
+		else
+			rmap[entry] = vpage;
+	}
+
+	return 0;
+}
 
 /**
  * @brief Give a free page to perform write
@@ -78,15 +690,14 @@ void project6_fix_free_page_pointer(uint64_t ppage)
  */
 static int get_free_page(uint64_t *ppage)
 {
-	if (data_config.read_only) {
+	if (data_config.read_only ||
+	    next_free_page(ppage, FRONTIER_USER, BLOCK_NONE)) {
+		/* Move to read only mode if no free page */
+		data_config.read_only = 1;
 		printk(PRINT_PREF "No free pages to give \n");
 		return -ENOMEM;
 	}
 
-	*ppage = current_free_page;
-
-	project6_fix_free_page_pointer(current_free_page+1);
-
 	return 0;
 }
 
@@ -107,6 +718,24 @@ uint8_t project6_get_ppage_state(uint64_t ppage)
 }
 
 
+/**
+ * @brief Gets the counter of a block for the given page state
+ *
+ * @param block Block number
+ * @param state State of the page
+ *
+ * @return Pointer to the counter
+ */
+static uint32_t *block_counter(uint64_t block, uint8_t state)
+{
+	if (state == PAGE_VALID)
+		return &block_info[block].valid;
+	if (state == PAGE_INVALID)
+		return &block_info[block].invalid;
+
+	return &block_info[block].free;
+}
+
 /**
  * @brief Set the state for the physical page
  *
@@ -117,9 +746,122 @@ void project6_set_ppage_state(uint64_t ppage, uint8_t state)
 {
 	uint64_t offset = ppage / 4;
 	int index = ppage % 4;
+	uint64_t block = ppage / data_config.pages_per_block;
+	uint8_t old = project6_get_ppage_state(ppage);
 
 	bitmap[offset] = (bitmap[offset] & ~(0x3 << index * 2)) |
 			((state & 0x3) << index * 2);
+
+	if (old != state) {
+		uint32_t invalid = block_info[block].invalid;
+
+		(*block_counter(block, old))--;
+		(*block_counter(block, state))++;
+
+		if (old == PAGE_FREE)
+			total_free_pages--;
+		else if (state == PAGE_FREE)
+			total_free_pages++;
+
+		if (invalid != block_info[block].invalid)
+			project6_gc_block_update(block, invalid,
+						 block_info[block].invalid);
+	}
+
+	if (state == PAGE_VALID)
+		block_info[block].last_write = ++write_clock;
+
+	project6_mark_meta_data_dirty(&bitmap[offset], 1);
+	project6_mark_meta_data_dirty(&block_info[block],
+				      sizeof(block_info[block]));
+}
+
+/**
+ * @brief Counts the free pages of the data partition
+ *
+ * @return Number of free pages
+ */
+uint64_t project6_count_free_pages(void)
+{
+	return total_free_pages;
+}
+
+/**
+ * @brief Sets up the page counts of the blocks, a fresh partition has every
+ * page free and a loaded one brings its counts from the meta-data
+ *
+ * @param read_disk true if the counts were read from the meta-data
+ */
+void project6_block_info_init(bool read_disk)
+{
+	uint64_t block;
+
+	total_free_pages = 0;
+	write_clock = 0;
+
+	for (block = 0; block < data_config.nb_blocks; block++) {
+		if (!read_disk) {
+			block_info[block].valid = 0;
+			block_info[block].invalid = 0;
+			block_info[block].free = data_config.pages_per_block;
+			block_info[block].last_write = 0;
+			block_info[block].erase_count = 0;
+			block_info[block].bad = 0;
+		}
+
+		total_free_pages += block_info[block].free;
+
+		if (block_info[block].last_write > write_clock)
+			write_clock = block_info[block].last_write;
+	}
+}
+
+/**
+ * @brief Gets the number of pages programmed since a page of the block was
+ * last programmed
+ *
+ * @param block Block number
+ *
+ * @return Age of the block
+ */
+uint32_t project6_block_age(uint64_t block)
+{
+	return write_clock - block_info[block].last_write;
+}
+
+/**
+ * @brief Prints the page counts of the data partition
+ */
+void project6_print_block_stats(void)
+{
+	uint64_t valid = 0;
+	uint64_t invalid = 0;
+	uint64_t erases = 0;
+	uint32_t min_erases = UINT_MAX;
+	uint32_t max_erases = 0;
+	uint64_t bad = 0;
+	uint64_t block;
+
+	if (!block_info)
+		return;
+
+	for (block = 0; block < data_config.nb_blocks; block++) {
+		if (block_info[block].bad) {
+			bad++;
+			continue;
+		}
+
+		valid += block_info[block].valid;
+		invalid += block_info[block].invalid;
+		erases += block_info[block].erase_count;
+		min_erases = min(min_erases, block_info[block].erase_count);
+		max_erases = max(max_erases, block_info[block].erase_count);
+	}
+
+	printk(PRINT_PREF "Pages valid: %llu invalid: %llu free: %llu\n",
+	       valid, invalid, total_free_pages);
+	printk(PRINT_PREF "Block erases min: %u max: %u total: %llu bad: %llu\n",
+	       min_erases, max_erases, erases, bad);
 }
 
 /**
@@ -139,7 +881,15 @@ static int create_mapping(uint64_t vpage, uint64_t *ppage)
 		return ret;
 	}
 
-	mapper[vpage] = *ppage;
+	ret = project6_set_vpage_mapping(vpage, *ppage);
+
+	/* The page was given, it stays unused until its block is erased */
+	if (ret) {
+		project6_set_ppage_state(*ppage, PAGE_INVALID);
+		return ret;
+	}
+
+	rmap[*ppage] = vpage;
 
 	project6_set_ppage_state(*ppage, PAGE_VALID);
 
@@ -150,6 +900,25 @@ static int create_mapping(uint64_t vpage, uint64_t *ppage)
 
 
 
+/**
+ * @brief Gives a free page outside of the given block
+ *
+ * @param ppage Pointer where the free page is returned
+ * @param blk_number Block number which must be avoided
+ *
+ * @return 0 on success, -ENOMEM on failure
+ */
+static int get_free_page_new_block(uint64_t *ppage, uint64_t blk_number)
+{
+	if (data_config.read_only ||
+	    next_free_page(ppage, FRONTIER_GC, blk_number)) {
+		printk(PRINT_PREF "could not create mapping due to no free page\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
 /**
  * @brief Creates a mapping in a block different than given block, it is used by
  * the garbage collection to find a mapping in the new block
@@ -163,26 +932,66 @@ static int create_mapping(uint64_t vpage, uint64_t *ppage)
 int project6_create_mapping_new_block(uint64_t vpage, uint64_t *ppage,
 			     uint64_t blk_number)
 {
-	int ret = get_free_page(ppage);
+	int ret = get_free_page_new_block(ppage, blk_number);
+
+	if (ret)
+		return ret;
+
+	ret = project6_set_vpage_mapping(vpage, *ppage);
 
 	if (ret) {
-		printk(PRINT_PREF "could not create mapping due to no free page\n");
+		project6_set_ppage_state(*ppage, PAGE_INVALID);
 		return ret;
 	}
 
-	/* iterate till we reach a new block */
-	while (*ppage >= blk_number * data_config.pages_per_block && *ppage <
-	       (blk_number + 1) * data_config.pages_per_block) {
+	rmap[*ppage] = vpage;
 
-		ret = get_free_page(ppage);
-		if (ret != 0) {
-			printk(PRINT_PREF "could not create mapping due to no free page\n");
-			return ret;
-		}
+	project6_set_ppage_state(*ppage, PAGE_VALID);
+
+	total_written_page++;
 
+	return 0;
+}
+
+/**
+ * @brief Takes a free page to be filled with packed records
+ *
+ * @param ppage Pointer where the page is returned
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_create_packed_page(uint64_t *ppage)
+{
+	int ret = get_free_page(ppage);
+
+	if (ret) {
+		printk(PRINT_PREF "could not create packed page\n");
+		return ret;
 	}
 
-	mapper[vpage] = *ppage;
+	project6_set_ppage_state(*ppage, PAGE_VALID);
+
+	total_written_page++;
+
+	return 0;
+}
+
+/**
+ * @brief Takes a free page outside of the given block, it is used by the
+ * garbage collection to migrate a packed page
+ *
+ * @param ppage Pointer where the page is returned
+ * @param blk_number Block number which must be avoided
+ *
+ * @return 0 on success, otherwise appropriate error code
+ */
+int project6_create_packed_page_new_block(uint64_t *ppage,
+					  uint64_t blk_number)
+{
+	int ret = get_free_page_new_block(ppage, blk_number);
+
+	if (ret)
+		return ret;
 
 	project6_set_ppage_state(*ppage, PAGE_VALID);
 
@@ -191,6 +1000,63 @@ int project6_create_mapping_new_block(uint64_t vpage, uint64_t *ppage,
 	return 0;
 }
 
+/**
+ * @brief Invalidates a packed page which has no live slot left
+ *
+ * @param ppage Packed page to be released
+ */
+void project6_release_packed_page(uint64_t ppage)
+{
+	project6_set_ppage_state(ppage, PAGE_INVALID);
+}
+
+/**
+ * @brief Maps a vpage to a slot of a packed page
+ *
+ * @param vpage Vpage of the record
+ * @param ppage Packed page holding the record
+ * @param slot Slot of the record in the page
+ *
+ * @return 0 on success, -EIO if the mapper cannot be updated
+ */
+int project6_map_slot(uint64_t vpage, uint64_t ppage, int slot)
+{
+	int ret = project6_set_vpage_mapping(vpage, MAPPER_PACK(ppage, slot));
+
+	if (ret)
+		return ret;
+
+	slot_live[ppage]++;
+
+	return 0;
+}
+
+/**
+ * @brief Gets the slot of a vpage mapped into a packed page
+ *
+ * @param vpage Vpage to be checked
+ * @param ppage Filled with the packed page if not NULL
+ *
+ * @return Slot index, -1 if the vpage does not map a slot, -EIO if the
+ * mapper cannot be read
+ */
+int project6_get_vpage_slot(uint64_t vpage, uint64_t *ppage)
+{
+	uint64_t entry;
+
+	if (project6_get_vpage_entry(vpage, &entry))
+		return -EIO;
+
+	if (entry == PAGE_UNALLOCATED || entry == PAGE_GARBAGE_RECLAIMED ||
+	    MAPPER_SLOT(entry) == 0)
+		return -1;
+
+	if (ppage)
+		*ppage = MAPPER_PPAGE(entry);
+
+	return MAPPER_SLOT(entry) - 1;
+}
+
 /**
  * @brief Create mapping for multiple pages
  *
@@ -203,18 +1069,28 @@ int project6_create_mapping_multipage(uint64_t vpage, uint32_t num_pages)
 {
 	uint32_t page = 0;
 	uint64_t lpage = vpage;
+	uint64_t entry;
 	uint64_t ppage;
+	int ret;
 
 	while (page < num_pages) {
-		if (mapper[lpage] != PAGE_UNALLOCATED &&
-		    mapper[lpage] != PAGE_GARBAGE_RECLAIMED) {
-			return -EPERM;
-		}
 		if (lpage == data_config.nb_blocks *
 				data_config.pages_per_block)
 			return -EPERM;
 
-		mapper[lpage] = PAGE_GARBAGE_RECLAIMED;
+		ret = project6_get_vpage_entry(lpage, &entry);
+
+		if (ret)
+			return ret;
+
+		if (!vpage_entry_free(entry))
+			return -EPERM;
+
+		ret = project6_set_vpage_mapping(lpage, PAGE_GARBAGE_RECLAIMED);
+
+		if (ret)
+			return ret;
+
 		lpage++;
 		page++;
 	}
@@ -223,9 +1099,11 @@ int project6_create_mapping_multipage(uint64_t vpage, uint32_t num_pages)
 	page = 0;
 
 	while (page < num_pages) {
-		if (create_mapping(lpage, &ppage)) {
+		ret = create_mapping(lpage, &ppage);
+
+		if (ret) {
 			printk("mapping failed for %llu \n", lpage);
-			return -ENOMEM;
+			return ret == -EIO ? ret : -ENOMEM;
 		}
 		lpage++;
 		page++;
@@ -249,7 +1127,9 @@ int project6_get_existing_mapping(uint64_t vpage, uint64_t *ppage)
 	if (vpage >= data_config.nb_blocks * data_config.pages_per_block)
 		return PAGE_NOT_MAPPED;
 
-	*ppage = mapper[vpage];
+	/* The vpage may hold a record, it must not be taken as free */
+	if (project6_get_vpage_entry(vpage, ppage))
+		return PAGE_LOOKUP_ERROR;
 
 	if (*ppage == PAGE_UNALLOCATED)
 		return PAGE_NOT_MAPPED;
@@ -257,6 +1137,8 @@ int project6_get_existing_mapping(uint64_t vpage, uint64_t *ppage)
 	if (*ppage == PAGE_GARBAGE_RECLAIMED)
 		return PAGE_RECLAIMED;
 
+	*ppage = MAPPER_PPAGE(*ppage);
+
 	return project6_get_ppage_state(*ppage);
 }
 
@@ -266,22 +1148,52 @@ int project6_get_existing_mapping(uint64_t vpage, uint64_t *ppage)
  * @param vpage Vpage to be marked invalid
  * @param num_pages Number of pages to be marked invalid
  *
- * @return 0 on success, otherwise -EPERM
+ * @return 0 on success, -EIO if the mapper cannot be read, otherwise -EPERM
  */
 int project6_mark_vpage_invalid(uint64_t vpage, uint64_t num_pages)
 {
 	int state;
+	int slot;
 	uint64_t i = 0;
 	uint64_t ppage;
 
+	/* Every page is looked up first, a mapper read failure leaves the
+	 * record as it was */
+	for (i = 0; i < num_pages; i++) {
+		state = project6_get_existing_mapping(vpage + i, &ppage);
+
+		if (state == PAGE_LOOKUP_ERROR)
+			return -EIO;
+	}
+
+	i = 0;
+
 	while (i < num_pages) {
 
 		state = project6_get_existing_mapping(vpage + i, &ppage);
 
+		if (state == PAGE_LOOKUP_ERROR)
+			return -EIO;
+
 		if (state != PAGE_VALID) {
 			printk(PRINT_PREF "Trying to mark a non-valid page as invalid\n");
 			return -EPERM;
 		}
+
+		slot = project6_get_vpage_slot(vpage + i, NULL);
+
+		if (slot == -EIO)
+			return slot;
+
+		/* A slot is freed right away, its page may still be live */
+		if (slot >= 0) {
+			if (project6_set_vpage_mapping(vpage + i,
+						       PAGE_GARBAGE_RECLAIMED))
+				return -EIO;
+			project6_packed_slot_invalid(ppage);
+			i++;
+			continue;
+		}
 		i++;
 
 		project6_set_ppage_state(ppage, PAGE_INVALID);